@@ -0,0 +1,220 @@
+// Benchmark harness for the RSA tools
+
+#include <stdio.h>
+#include <gmp.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "randstate.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "tune.h"
+#include "arena.h"
+
+#define OPTIONS "hmb:t:c:k:s:"
+
+void print_help() {
+    printf("SYNOPSIS\n");
+    printf("   Benchmarks prime search and file encryption from 1 to N threads,\n");
+    printf("   then keys and private operations with 2 to %d primes.\n", RSA_MAX_PRIMES);
+    printf("\n");
+    printf("USAGE\n");
+    printf("   ./bench [-hm] [-b bits] [-t threads] [-c primes] [-k kbytes] [-s seed]\n");
+    printf("\n");
+    printf("OPTIONS\n");
+    printf("   -h              Display program help and usage.\n");
+    printf("   -m              Pool GMP memory in the arena (default: count only).\n");
+    printf("   -b bits         Modulus size to benchmark (default: 1024).\n");
+    printf("   -t threads      Largest thread count to try (default: online cores).\n");
+    printf("   -c primes       Primes of bits/2 to find per run (default: 8).\n");
+    printf("   -k kbytes       Kilobytes of data to encrypt per run (default: 64).\n");
+    printf("   -s seed         Random seed (default: 2022).\n");
+}
+
+// seconds of wall time
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// random source throughput, ChaCha against the original Mersenne Twister
+static void bench_rand(uint64_t bits) {
+    const rand_kind_t kinds[] = { RAND_CHACHA, RAND_MT };
+    const char *names[] = { "chacha", "mt" };
+    size_t len = 1 << 20;
+    uint8_t *bytes = (uint8_t *) malloc(len);
+    mpz_t x;
+    mpz_init(x);
+
+    printf("source    MB/s  %" PRIu64 "-bit draws/s\n", bits);
+    for (int i = 0; i < 2; i += 1) {
+        rand_src_t r;
+        rand_init(&r, kinds[i], 2022);
+
+        double start = now();
+        for (int rep = 0; rep < 16; rep += 1) {
+            rand_bytes(&r, bytes, len);
+        }
+        double mbs = 16.0 / (now() - start);
+
+        start = now();
+        for (int rep = 0; rep < 100000; rep += 1) {
+            rand_urandomb(x, &r, bits);
+        }
+        double draws = 100000 / (now() - start);
+
+        printf("%-6s  %6.1f  %12.0f\n", names[i], mbs, draws);
+        rand_clear(&r);
+    }
+
+    mpz_clear(x);
+    free(bytes);
+}
+
+// keys/s and private operations/s on one thread for 2 up to RSA_MAX_PRIMES primes
+// the first row is m^d mod n without the primes, the others go through CRT
+static void bench_primes(uint64_t bits) {
+    uint32_t threads = tune.threads;
+    tune.threads = 1;
+    const uint64_t keys = 2;
+    const uint64_t ops = 64;
+
+    mpz_t n, e, d, m, c;
+    mpz_inits(n, e, d, m, c, NULL);
+    rsa_crt_t crt;
+    rsa_crt_init(&crt);
+
+    printf("primes    keys/s   private ops/s  speedup\n");
+    double base = 0.0;
+    for (size_t count = 2; count <= RSA_MAX_PRIMES && bits >= 32 * count; count += 1) {
+        double start = now();
+        for (uint64_t i = 0; i < keys; i += 1) {
+            rsa_make_pub_crt(&crt, count, n, e, bits, 50);
+        }
+        double key_rate = keys / (now() - start);
+        rsa_make_priv_crt(d, e, &crt);
+        rand_urandomb(m, &state, bits - 1);
+
+        // the plain exponentiation once, on the two prime key
+        if (count == 2) {
+            start = now();
+            for (uint64_t i = 0; i < ops; i += 1) {
+                pow_mod_window(c, m, d, n, tune.window);
+            }
+            base = ops / (now() - start);
+            printf("%-6s  %8.2f  %14.1f  %6.2fx\n", "2 m^d", key_rate, base, 1.0);
+        }
+
+        start = now();
+        for (uint64_t i = 0; i < ops; i += 1) {
+            rsa_crt_pow(c, m, &crt, tune.window);
+        }
+        double op_rate = ops / (now() - start);
+        printf("%-6zu  %8.2f  %14.1f  %6.2fx\n", count, key_rate, op_rate, op_rate / base);
+    }
+
+    rsa_crt_clear(&crt);
+    mpz_clears(n, e, d, m, c, NULL);
+    tune.threads = threads;
+}
+
+int main(int argc, char **argv) {
+    uint64_t bits = 1024;
+    uint64_t seed = 2022;
+    uint32_t maxthreads = 0;
+    uint64_t primes = 8;
+    uint64_t kbytes = 64;
+    bool pooled = false;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'm': pooled = true; break;
+        case 'b': bits = strtoull(optarg, NULL, 10); break;
+        case 't': maxthreads = (uint32_t) strtoul(optarg, NULL, 10); break;
+        case 'c': primes = strtoull(optarg, NULL, 10); break;
+        case 'k': kbytes = strtoull(optarg, NULL, 10); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'h':
+        default: print_help(); return 0;
+        }
+    }
+
+    // count GMP's allocations either way, so runs with and without -m compare
+    arena_install(bits, pooled);
+
+    tune_defaults(&tune, bits);
+    tune_load(&tune, bits, TUNE_PROFILE);
+    if (maxthreads == 0) {
+        maxthreads = tune.threads;
+    }
+    randstate_init(seed);
+
+    // one key for the block runs
+    mpz_t p, q, n, e, d;
+    mpz_inits(p, q, n, e, d, NULL);
+    rsa_make_pub(p, q, n, e, bits, 50);
+    rsa_make_priv(d, e, p, q);
+
+    // random plaintext and a sink for the ciphertext
+    FILE *plain = tmpfile();
+    FILE *sink = fopen("/dev/null", "w");
+    if (!plain || !sink) {
+        fprintf(stderr, "Error: unable to open benchmark files.\n");
+        return 1;
+    }
+    for (uint64_t i = 0; i < kbytes * 1024; i += 1) {
+        uint8_t byte;
+        rand_bytes(&state, &byte, 1);
+        fputc(byte, plain);
+    }
+    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    uint64_t blocks = (kbytes * 1024) / (k - 1) + 1;
+
+    bench_rand(bits);
+
+    printf("%" PRIu64 "-bit key, window %" PRIu32 ", batch %" PRIu32 "\n", bits, tune.window,
+        tune.batch);
+    printf("threads  primes/s  speedup  blocks/s  speedup\n");
+
+    double prime_base = 0.0;
+    double block_base = 0.0;
+    for (uint32_t t = 1; t <= maxthreads; t += 1) {
+        tune.threads = t;
+
+        // prime search
+        double start = now();
+        for (uint64_t i = 0; i < primes; i += 1) {
+            make_prime(p, bits / 2, 50);
+        }
+        double prime_rate = primes / (now() - start);
+
+        // file encryption
+        rewind(plain);
+        start = now();
+        rsa_encrypt_file(plain, sink, n, e);
+        double block_rate = blocks / (now() - start);
+
+        if (t == 1) {
+            prime_base = prime_rate;
+            block_base = block_rate;
+        }
+        printf("%7" PRIu32 "  %8.2f  %6.2fx  %8.1f  %6.2fx\n", t, prime_rate,
+            prime_rate / prime_base, block_rate, block_rate / block_base);
+    }
+
+    bench_primes(bits);
+
+    // allocation counts for the whole run
+    arena_print(stdout);
+
+    fclose(plain);
+    fclose(sink);
+    mpz_clears(p, q, n, e, d, NULL);
+    randstate_clear();
+    return 0;
+}
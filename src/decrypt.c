@@ -13,8 +13,10 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "tune.h"
+#include "arena.h"
 
-#define OPTIONS "hvi:o:n:"
+#define OPTIONS "hvami:o:n:c:r:"
 
 // helper function to print out help command when -h is enabled
 void print_help() {
@@ -23,14 +25,19 @@ void print_help() {
     printf("   Encrypted data is encrypted by the encrypt program.\n");
     printf("\n");
     printf("USAGE\n");
-    printf("   ./decrypt [-hv] [-i infile] [-o outfile] -n privkey\n");
+    printf("   ./decrypt [-hvam] [-i infile] [-o outfile] [-c ckptfile] [-r offset:len] -n privkey\n");
     printf("\n");
     printf("OPTIONS\n");
     printf("   -h              Display program help and usage.\n");
     printf("   -v              Display verbose program output.\n");
+    printf("   -m              Pool GMP memory in a zeroizing arena.\n");
+    printf("   -a              Calibrate settings for this key size, save to " TUNE_PROFILE
+           " and exit.\n");
     printf("   -i infile       Input file of data to decrypt (default: stdin).\n");
     printf("   -o outfile      Output file for decrypted data (default: stdout).\n");
     printf("   -n pvfile       Private key file (default: rsa.priv).\n");
+    printf("   -c ckptfile     Checkpoint progress to ckptfile and resume from it.\n");
+    printf("   -r offset:len   Decrypt only len bytes at offset (file made by encrypt -f).\n");
 }
 
 int main(int argc, char **argv) {
@@ -41,9 +48,16 @@ int main(int argc, char **argv) {
     FILE *privfile = NULL;
     bool verbose = false;
     bool readpriv = true;
+    bool autotune = false;
+    bool arena = false;
+    char *outpath = NULL; // opened after the options, see -c
+    char *ckpath = NULL;
+    bool ranged = false;
+    uint64_t offset = 0;
+    uint64_t len = 0;
 
+    // set up once the arena (-m) is in place
     mpz_t n, d;
-    mpz_inits(n, d, NULL);
 
     // user input/help manual
     int opt = 0;
@@ -56,6 +70,12 @@ int main(int argc, char **argv) {
         case 'v': // enable verbose
             verbose = true;
             break;
+        case 'a': // calibrate instead of decrypting
+            autotune = true;
+            break;
+        case 'm': // pool GMP memory
+            arena = true;
+            break;
         case 'i': //infile
 
             infile = fopen(optarg, "r");
@@ -68,21 +88,21 @@ int main(int argc, char **argv) {
                 if (privfile) {
                     fclose(privfile);
                 }
-                mpz_clears(n, d, NULL);
                 return 0;
             }
             break;
-        case 'o': // outfile
-            outfile = fopen(optarg, "w");
-            if (!outfile) {
-                fprintf(stderr, "Error: unable to write file.\n");
-                if (infile) {
-                    fclose(infile);
-                }
-                if (privfile) {
-                    fclose(privfile);
-                }
-                mpz_clears(n, d, NULL);
+        case 'o': // file to output to (default is stdout)
+            outpath = optarg;
+            break;
+        case 'c': // checkpoint file for resumable runs
+            ckpath = optarg;
+            break;
+        case 'r': // byte range of the plaintext
+            ranged = true;
+            // SCNu64 takes a minus sign and wraps, so a negative value would be huge
+            if (strchr(optarg, '-') || sscanf(optarg, "%" SCNu64 ":%" SCNu64, &offset, &len) != 2) {
+                fprintf(stderr, "Error: -r takes offset:len.\n");
+                print_help();
                 return 0;
             }
             break;
@@ -97,7 +117,6 @@ int main(int argc, char **argv) {
                 if (outfile) {
                     fclose(outfile);
                 }
-                mpz_clears(n, d, NULL);
                 return 0;
             }
             break;
@@ -107,6 +126,61 @@ int main(int argc, char **argv) {
             break;
         }
     }
+
+    // route GMP through the arena before any number is made, sized once the key is read
+    if (arena) {
+        arena_install(0, true);
+    }
+    mpz_inits(n, d, NULL);
+
+    // a range is a single read with nothing to resume
+    if (ranged && ckpath) {
+        fprintf(stderr, "Error: -r does not go with -c.\n");
+        if (infile) {
+            fclose(infile);
+        }
+        if (privfile) {
+            fclose(privfile);
+        }
+        mpz_clears(n, d, NULL);
+        return 0;
+    }
+
+    // resuming needs to seek both files, checked before -o is opened (and truncated)
+    if (ckpath && (infile == stdin || !outpath)) {
+        fprintf(stderr, "Error: -c needs -i and -o files.\n");
+        if (infile) {
+            fclose(infile);
+        }
+        if (privfile) {
+            fclose(privfile);
+        }
+        mpz_clears(n, d, NULL);
+        return 0;
+    }
+
+    // open the output now that we know whether we are resuming
+    // a resumed run keeps the output its checkpoint covers
+    if (outpath) {
+        rsa_ckpt_t ckpt;
+        bool resume = ckpath && rsa_ckpt_read(&ckpt, ckpath);
+        outfile = fopen(outpath, resume ? "r+" : "w+"); // read back for the checkpoint head
+        if (!outfile) {
+            fprintf(stderr, "Error: unable to write file.\n");
+            if (infile) {
+                fclose(infile);
+            }
+            if (privfile) {
+                fclose(privfile);
+            }
+            mpz_clears(n, d, NULL);
+            return 0;
+        }
+        if (resume && verbose) {
+            printf("resuming at block %" PRIu64 "\n", ckpt.blocks);
+        }
+    }
+
     // if no private key was specify
     // open default private key file
     if (readpriv) {
@@ -125,7 +199,11 @@ int main(int argc, char **argv) {
     }
 
     // read the private key from the opened private key file
+    // keys from keygen also list the primes of n, which make decryption CRT
     rsa_read_priv(n, d, privfile);
+    rsa_crt_t crt;
+    rsa_crt_init(&crt);
+    rsa_read_crt(&crt, n, d, privfile);
 
     //if verbose is true
     size_t numbits;
@@ -136,12 +214,72 @@ int main(int argc, char **argv) {
 
         numbits = mpz_sizeinbase(d, 2);
         gmp_printf("d (%d bits) = %Zd\n", numbits, d); // private key
+
+        printf("crt primes = %zu\n", crt.count); // 0 for a key without its primes
+    }
+
+    // load the saved settings for this key size, defaults if there are none
+    uint64_t keybits = mpz_sizeinbase(n, 2);
+    if (arena) {
+        arena_size(keybits);
+    }
+    tune_defaults(&tune, keybits);
+    tune_load(&tune, keybits, TUNE_PROFILE);
+
+    // autotune mode: calibrate for this key size, save the profile and exit
+    if (autotune) {
+        tune_calibrate(&tune, keybits, verbose);
+        if (!tune_save(&tune, TUNE_PROFILE)) {
+            fprintf(stderr, "Error: unable to write " TUNE_PROFILE ".\n");
+        }
+        tune_print(&tune, stdout);
+        rsa_crt_clear(&crt);
+        mpz_clears(n, d, NULL);
+        fclose(infile);
+        fclose(outfile);
+        fclose(privfile);
+        return 0;
+    }
+    if (verbose == true) {
+        tune_print(&tune, stdout);
+    }
+
+    // a context with the key and its primes, so each block is decrypted through CRT
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, 0);
+    rsa_ctx_set_tune(&ctx, &tune);
+    rsa_ctx_set_priv(&ctx, n, d);
+    rsa_ctx_set_crt(&ctx, &crt);
+
+    if (ranged) {
+        // decrypt only the blocks covering the range
+        if (infile == stdin || !rsa_ctx_decrypt_range(&ctx, infile, outfile, offset, len)) {
+            fprintf(stderr, "Error: -r needs a seekable -i file made by encrypt -f and a range "
+                            "inside its plaintext.\n");
+        }
+    } else {
+        //decrypt file using rsa_ctx_decrypt_file() (no checkpoints without -c)
+        rsa_file_opts_t opts = { ckpath, false, false, 0, 0, false };
+        if (!rsa_ctx_decrypt_file(&ctx, infile, outfile, &opts)) {
+            if (opts.ckpt_failed) {
+                fprintf(stderr, "Error: checkpoint %s does not match this run or cannot be written.\n",
+                    ckpath);
+            } else {
+                fprintf(stderr, "Error: unable to decrypt this file with this key, or it was changed.\n");
+                if (ckpath) {
+                    fprintf(stderr, "Compressed and multi-recipient files do not take -c.\n");
+                }
+            }
+        }
     }
 
-    //decrypt file using rsa_decrypt_file()
-    rsa_decrypt_file(infile, outfile, n, d);
+    if (arena && verbose) {
+        arena_print(stdout);
+    }
 
     // free memory
+    rsa_ctx_clear(&ctx);
+    rsa_crt_clear(&crt);
     mpz_clears(n, d, NULL);
     fclose(infile);
     fclose(outfile);
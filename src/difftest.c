@@ -0,0 +1,528 @@
+// Differential test harness: numtheory against GMP's built-ins, and file round trips
+
+#include <stdio.h>
+#include <gmp.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "randstate.h"
+#include "numtheory.h"
+#include "keypool.h"
+#include "rsa.h"
+#include "tune.h"
+
+#define OPTIONS "hvn:b:r:s:t:"
+
+void print_help() {
+    printf("SYNOPSIS\n");
+    printf("   Checks pow_mod, pow_mod_window, gcd, mod_inverse and is_prime against\n");
+    printf("   mpz_powm, mpz_gcd, mpz_invert and mpz_probab_prime_p on random operands,\n");
+    printf("   then round trips random files through rsa_encrypt_file and a CRT decrypt\n");
+    printf("   with keys of 2 to %d primes, checking rsa_crt_pow against mpz_powm.\n", RSA_MAX_PRIMES);
+    printf("   Seeded keys are made at one thread and at -t threads and have to match.\n");
+    printf("   Multi-recipient files open with every key and not once a digit is changed.\n");
+    printf("   Pool refills have to give fresh primes whatever the seed.\n");
+    printf("   Exits 1 on the first run with a mismatch.\n");
+    printf("\n");
+    printf("USAGE\n");
+    printf("   ./difftest [-hv] [-n ops] [-b bits] [-r trips] [-s seed] [-t threads]\n");
+    printf("\n");
+    printf("OPTIONS\n");
+    printf("   -h              Display program help and usage.\n");
+    printf("   -v              Print every mismatch in full.\n");
+    printf("   -n ops          Random operand sets to check (default: 10000).\n");
+    printf("   -b bits         Largest operand size (default: 512).\n");
+    printf("   -r trips        Encrypt/decrypt round trips (default: 50).\n");
+    printf("   -s seed         Random seed (default: 2022).\n");
+    printf("   -t threads      Thread count to check against one thread (default: 4).\n");
+}
+
+// mismatches so far
+static uint64_t failures = 0;
+static bool verbose = false;
+
+// operand size, mostly one below, on or one above a limb boundary
+static uint64_t pick_bits(uint64_t maxbits) {
+    if (rand_urandomm_ui(&state, 8) == 0) {
+        return 1 + rand_urandomm_ui(&state, 16); // a few tiny ones
+    }
+    uint64_t limbs = 1 + rand_urandomm_ui(&state, maxbits / GMP_NUMB_BITS);
+    return limbs * GMP_NUMB_BITS - 1 + rand_urandomm_ui(&state, 3);
+}
+
+// random operand of up to bits, with the edge values (0, 1, all ones, top bit set) common
+static void pick(mpz_t x, uint64_t bits) {
+    switch (rand_urandomm_ui(&state, 16)) {
+    case 0: mpz_set_ui(x, 0); break;
+    case 1: mpz_set_ui(x, 1); break;
+    case 2: // 2^bits - 1, every limb full
+        mpz_set_ui(x, 0);
+        mpz_setbit(x, bits);
+        mpz_sub_ui(x, x, 1);
+        break;
+    default:
+        rand_urandomb(x, &state, bits);
+        if (rand_urandomm_ui(&state, 2) == 0) {
+            mpz_setbit(x, bits - 1);
+        }
+        break;
+    }
+}
+
+// report a mismatch between ours and GMP's
+static void mismatch(const char *op, mpz_t a, mpz_t b, mpz_t c, mpz_t ours, mpz_t gmps) {
+    failures += 1;
+    if (verbose) {
+        gmp_fprintf(stderr, "%s mismatch\n a = %Zx\n b = %Zx\n c = %Zx\n ours = %Zx\n gmp = %Zx\n",
+            op, a, b, c, ours, gmps);
+    } else if (failures <= 10) {
+        gmp_fprintf(stderr, "%s mismatch (%zu, %zu, %zu bits)\n", op, mpz_sizeinbase(a, 2),
+            mpz_sizeinbase(b, 2), mpz_sizeinbase(c, 2));
+    }
+}
+
+// one random operand set through every routine
+static void check_ops(uint64_t maxbits) {
+    mpz_t a, b, m, ours, gmps, zero;
+    mpz_inits(a, b, m, ours, gmps, zero, NULL);
+
+    pick(a, pick_bits(maxbits));
+    pick(b, pick_bits(maxbits));
+    pick(m, pick_bits(maxbits));
+
+    // exponentiation, a modulus of 0 has no answer and 1 only matters as an edge
+    if (mpz_cmp_ui(m, 2) >= 0) {
+        mpz_powm(gmps, a, b, m);
+        pow_mod(ours, a, b, m);
+        if (mpz_cmp(ours, gmps) != 0) {
+            mismatch("pow_mod", a, b, m, ours, gmps);
+        }
+        uint32_t window = 1 + rand_urandomm_ui(&state, POW_MOD_MAX_WINDOW);
+        pow_mod_window(ours, a, b, m, window);
+        if (mpz_cmp(ours, gmps) != 0) {
+            mismatch("pow_mod_window", a, b, m, ours, gmps);
+        }
+    }
+
+    // gcd of any two
+    mpz_gcd(gmps, a, b);
+    gcd(ours, a, b);
+    if (mpz_cmp(ours, gmps) != 0) {
+        mismatch("gcd", a, b, zero, ours, gmps);
+    }
+
+    // inverse, mod_inverse gives 0 where mpz_invert finds none
+    if (mpz_cmp_ui(m, 2) >= 0) {
+        if (mpz_invert(gmps, a, m) == 0) {
+            mpz_set_ui(gmps, 0);
+        }
+        mod_inverse(ours, a, m);
+        if (mpz_cmp(ours, gmps) != 0) {
+            mismatch("mod_inverse", a, m, zero, ours, gmps);
+        }
+    }
+
+    // primality, on a random number and on a prime next to it
+    // 25 rounds each side puts a false answer far below anything we will see
+    for (int round = 0; round < 2; round += 1) {
+        if (round == 1) {
+            mpz_nextprime(a, a);
+        }
+        bool mine = is_prime(a, 25);
+        bool theirs = mpz_probab_prime_p(a, 25) != 0;
+        if (mine != theirs) {
+            mpz_set_ui(ours, mine);
+            mpz_set_ui(gmps, theirs);
+            mismatch("is_prime", a, zero, zero, ours, gmps);
+        }
+    }
+
+    mpz_clears(a, b, m, ours, gmps, zero, NULL);
+}
+
+// the whole of two files is the same, both are left rewound
+static bool same_file(FILE *a, FILE *b) {
+    rewind(a);
+    rewind(b);
+    int x, y;
+    do {
+        x = fgetc(a);
+        y = fgetc(b);
+    } while (x == y && x != EOF);
+    rewind(a);
+    rewind(b);
+    return x == y;
+}
+
+// encrypt or decrypt infile into outfile with a context at the given settings
+// a decrypt goes through CRT when crt is not NULL
+static bool trip_run(bool encrypt, FILE *infile, FILE *outfile, mpz_t n, mpz_t key,
+    rsa_crt_t *crt, tune_t *t, rsa_file_opts_t *opts) {
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, 0);
+    rsa_ctx_set_tune(&ctx, t);
+    rewind(infile);
+    bool ok;
+    if (encrypt) {
+        rsa_ctx_set_pub(&ctx, n, key);
+        ok = rsa_ctx_encrypt_file(&ctx, infile, outfile, opts);
+    } else {
+        rsa_ctx_set_priv(&ctx, n, key);
+        if (crt) {
+            rsa_ctx_set_crt(&ctx, crt);
+        }
+        ok = rsa_ctx_decrypt_file(&ctx, infile, outfile, opts);
+    }
+    rsa_ctx_clear(&ctx);
+    return ok;
+}
+
+// a random slice of a seekable ciphertext through rsa_decrypt_range matches plain,
+// and a slice one byte past the end (or wrapping around) is refused with nothing written
+static bool check_range(FILE *cipher, mpz_t n, mpz_t d, uint8_t *plain, size_t len) {
+    uint64_t offset = rand_urandomm_ui(&state, len + 1);
+    uint64_t want = rand_urandomm_ui(&state, len - offset + 1);
+    uint8_t *back = (uint8_t *) malloc(want + 1);
+    FILE *outfile = tmpfile();
+
+    rewind(cipher);
+    bool ok = rsa_decrypt_range(cipher, outfile, n, d, offset, want);
+    rewind(outfile);
+    ok = ok && fread(back, sizeof(uint8_t), want + 1, outfile) == want
+         && memcmp(back, plain + offset, want) == 0;
+
+    rewind(cipher);
+    ok = ok && !rsa_decrypt_range(cipher, outfile, n, d, offset, len - offset + 1);
+    rewind(cipher);
+    ok = ok && !rsa_decrypt_range(cipher, outfile, n, d, UINT64_MAX, 2);
+    ok = ok && ftell(outfile) == (long) want;
+
+    fclose(outfile);
+    free(back);
+    return ok;
+}
+
+// encrypt a random file with a random key of 2 or more primes, decrypt it through CRT
+// and through plain d and compare both, lengths sit around the block size so the short
+// last block and the pad only block get hit
+// it is encrypted on one thread and again across threads with a batch of a few blocks,
+// so the pool's batch edges get crossed, and the two ciphertexts have to be the same
+static void check_trip(uint64_t maxbits, uint32_t threads) {
+    uint64_t bits = 64 + rand_urandomm_ui(&state, maxbits - 63); // maxbits is at least a limb
+    uint64_t most = bits / 32 < RSA_MAX_PRIMES ? bits / 32 : RSA_MAX_PRIMES;
+    size_t count = 2 + rand_urandomm_ui(&state, most - 1);
+    mpz_t n, e, d, m, ours, gmps;
+    mpz_inits(n, e, d, m, ours, gmps, NULL);
+    rsa_crt_t crt;
+    rsa_crt_init(&crt);
+    rsa_make_pub_crt(&crt, count, n, e, bits, 25);
+    rsa_make_priv_crt(d, e, &crt);
+
+    // the CRT private operation against a plain one, on a random m and on the edges
+    for (int round = 0; round < 4; round += 1) {
+        switch (round) {
+        case 0: mpz_set_ui(m, 0); break;
+        case 1: mpz_set(m, crt.r[0]); break; // shares a factor with n
+        case 2: mpz_sub_ui(m, n, 1); break;
+        default: rand_urandomb(m, &state, bits - 1); break;
+        }
+        mpz_powm(gmps, m, d, n);
+        rsa_crt_pow(ours, m, &crt, 1 + rand_urandomm_ui(&state, POW_MOD_MAX_WINDOW));
+        if (mpz_cmp(ours, gmps) != 0) {
+            mismatch("rsa_crt_pow", m, d, n, ours, gmps);
+        }
+    }
+
+    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    size_t len;
+    switch (rand_urandomm_ui(&state, 4)) {
+    case 0: len = 0; break;
+    case 1: len = (k - 1) * rand_urandomm_ui(&state, 4); break; // whole blocks
+    case 2: len = (k - 1) * rand_urandomm_ui(&state, 4) + rand_urandomm_ui(&state, k); break;
+    default: len = rand_urandomm_ui(&state, 8192); break;
+    }
+    uint8_t *plain = (uint8_t *) malloc(len + 1);
+    uint8_t *back = (uint8_t *) malloc(len + 1);
+    rand_bytes(&state, plain, len);
+
+    FILE *infile = tmpfile();
+    FILE *cipher = tmpfile();
+    FILE *pooled = tmpfile();
+    fwrite(plain, sizeof(uint8_t), len, infile);
+
+    tune_t one = tune;
+    one.threads = 1;
+    tune_t many = tune;
+    many.threads = threads;
+    many.batch = 1 + rand_urandomm_ui(&state, 8);
+
+    // either block layout or compressed, all have to come back the same
+    uint64_t mode = rand_urandomm_ui(&state, 3);
+    rsa_file_opts_t opts = { NULL, mode == 1, mode == 2, 0, 0, false };
+    rsa_file_opts_t pooled_opts = opts;
+    trip_run(true, infile, cipher, n, e, NULL, &one, &opts);
+    trip_run(true, infile, pooled, n, e, NULL, &many, &pooled_opts);
+    if (!same_file(cipher, pooled)) {
+        failures += 1;
+        fprintf(stderr, "pooled encrypt mismatch (%" PRIu64 "-bit key, %zu bytes, batch %" PRIu32 ")\n",
+            bits, len, many.batch);
+    }
+
+    // back through CRT across threads and through plain d on one thread
+    for (int path = 0; path < 2; path += 1) {
+        rsa_file_opts_t plain_opts = { NULL, false, false, 0, 0, false };
+        FILE *outfile = tmpfile();
+        trip_run(false, cipher, outfile, n, d, path == 0 ? &crt : NULL, path == 0 ? &many : &one,
+            &plain_opts);
+
+        long got = ftell(outfile);
+        rewind(outfile);
+        size_t read = fread(back, sizeof(uint8_t), len + 1, outfile);
+        if (got != (long) len || read != len || memcmp(plain, back, len) != 0) {
+            failures += 1;
+            fprintf(stderr,
+                "round trip mismatch (%" PRIu64 "-bit key, %zu primes, %s, %zu bytes in, %ld out%s)\n",
+                bits, count, path == 0 ? "CRT" : "plain d", len, got,
+                opts.seekable ? ", seekable" : opts.compress ? ", compressed" : "");
+        }
+        fclose(outfile);
+    }
+
+    // a seekable file also gives back a random slice, and refuses one running past the end
+    if (opts.seekable && !check_range(cipher, n, d, plain, len)) {
+        failures += 1;
+        fprintf(stderr, "range mismatch (%" PRIu64 "-bit key, %zu bytes)\n", bits, len);
+    }
+
+    fclose(infile);
+    fclose(cipher);
+    fclose(pooled);
+    free(plain);
+    free(back);
+    rsa_crt_clear(&crt);
+    mpz_clears(n, e, d, m, ours, gmps, NULL);
+}
+
+// a random file for two keys in one multi-recipient file opens with either key,
+// and with one payload digit or the tag changed it is refused with nothing written
+static void check_multi(uint64_t maxbits) {
+    mpz_t ns[2], es[2], ds[2];
+    rsa_crt_t crts[2];
+    for (int i = 0; i < 2; i += 1) {
+        uint64_t bits = 64 + rand_urandomm_ui(&state, maxbits - 63);
+        mpz_inits(ns[i], es[i], ds[i], NULL);
+        rsa_crt_init(&crts[i]);
+        rsa_make_pub_crt(&crts[i], 2, ns[i], es[i], bits, 25);
+        rsa_make_priv_crt(ds[i], es[i], &crts[i]);
+    }
+
+    size_t len = rand_urandomm_ui(&state, 8192);
+    uint8_t *plain = (uint8_t *) malloc(len + 1);
+    uint8_t *back = (uint8_t *) malloc(len + 1);
+    rand_bytes(&state, plain, len);
+    FILE *infile = tmpfile();
+    FILE *cipher = tmpfile();
+    fwrite(plain, sizeof(uint8_t), len, infile);
+    rewind(infile);
+    bool ok = rsa_encrypt_multi(infile, cipher, 2, ns, es);
+
+    tune_t one = tune;
+    rsa_file_opts_t opts = { NULL, false, false, 0, 0, false };
+    for (int i = 0; i < 2 && ok; i += 1) {
+        FILE *outfile = tmpfile();
+        ok = trip_run(false, cipher, outfile, ns[i], ds[i], &crts[i], &one, &opts);
+        rewind(outfile);
+        ok = ok && fread(back, sizeof(uint8_t), len + 1, outfile) == len
+             && memcmp(back, plain, len) == 0;
+        fclose(outfile);
+    }
+
+    // flip one hex digit past the key lines, in the payload or in the tag
+    long size = 0;
+    char *text = NULL;
+    if (ok) {
+        fseek(cipher, 0, SEEK_END);
+        size = ftell(cipher);
+        text = (char *) malloc(size);
+        rewind(cipher);
+        ok = fread(text, sizeof(char), size, cipher) == (size_t) size;
+    }
+    if (ok) {
+        long start = 0;
+        for (int lines = 0; lines < 3; start += 1) {
+            lines += text[start] == '\n';
+        }
+        long at;
+        do {
+            at = start + rand_urandomm_ui(&state, size - start);
+        } while (text[at] == '\n' || text[at] == '#' || (text[at] >= 'g' && text[at] <= 'z')
+                 || text[at] == '=');
+        text[at] = text[at] == '0' ? '1' : '0';
+        FILE *tampered = tmpfile();
+        FILE *outfile = tmpfile();
+        fwrite(text, sizeof(char), size, tampered);
+        ok = !trip_run(false, tampered, outfile, ns[0], ds[0], &crts[0], &one, &opts)
+             && ftell(outfile) == 0;
+        fclose(tampered);
+        fclose(outfile);
+    }
+    if (!ok) {
+        failures += 1;
+        fprintf(stderr, "multi mismatch (%zu bytes)\n", len);
+    }
+
+    fclose(infile);
+    fclose(cipher);
+    free(text);
+    free(plain);
+    free(back);
+    for (int i = 0; i < 2; i += 1) {
+        rsa_crt_clear(&crts[i]);
+        mpz_clears(ns[i], es[i], ds[i], NULL);
+    }
+}
+
+// a seeded key of a random width and prime count, made at one thread and at threads,
+// the prime search splits its work by thread count but has to give the same key
+static void check_keygen(uint64_t maxbits, uint32_t threads) {
+    uint64_t bits = 64 + rand_urandomm_ui(&state, maxbits - 63);
+    uint64_t most = bits / 32 < RSA_MAX_PRIMES ? bits / 32 : RSA_MAX_PRIMES;
+    size_t count = 2 + rand_urandomm_ui(&state, most - 1);
+    uint64_t seed = rand_urandomm_ui(&state, UINT64_MAX);
+
+    rsa_ctx_t one, many;
+    tune_t t = tune;
+    rsa_ctx_init(&one, seed);
+    t.threads = 1;
+    rsa_ctx_set_tune(&one, &t);
+    rsa_ctx_make_keys_crt(&one, count, bits, 25);
+    rsa_ctx_init(&many, seed);
+    t.threads = threads;
+    rsa_ctx_set_tune(&many, &t);
+    rsa_ctx_make_keys_crt(&many, count, bits, 25);
+
+    if (mpz_cmp(one.n, many.n) != 0 || mpz_cmp(one.e, many.e) != 0) {
+        mismatch("seeded keygen", one.e, many.e, one.d, one.n, many.n);
+    }
+
+    rsa_ctx_clear(&one);
+    rsa_ctx_clear(&many);
+}
+
+// a refill never draws from the seeded global state: two fresh pools filled right after
+// the same randstate_init hold different primes, every pair comes back once as primes of
+// a bits wide n, a take from the emptied pool is a miss, and the takes left only the header
+// reseeds the global state, so it runs last
+static bool check_pool(uint64_t bits, uint64_t seed) {
+    char paths[2][32] = { "/tmp/difftest.pool.XXXXXX", "/tmp/difftest.pool.XXXXXX" };
+    mpz_t p[3], q[3], n;
+    mpz_inits(p[0], q[0], p[1], q[1], p[2], q[2], n, NULL);
+    keypool_stats_t stats;
+    uint64_t made = 0;
+    bool ok = true;
+
+    for (int i = 0; i < 2; i += 1) {
+        int fd = mkstemp(paths[i]);
+        ok = ok && fd >= 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    randstate_clear();
+    randstate_init(seed);
+    ok = ok && keypool_fill(paths[0], bits, 25, 2, &made) && made == 2;
+    randstate_clear();
+    randstate_init(seed);
+    ok = ok && keypool_fill(paths[1], bits, 25, 1, &made) && made == 1
+         && keypool_count(paths[0], bits) == 2 && keypool_count(paths[1], bits) == 1;
+
+    for (int i = 0; i < 3 && ok; i += 1) {
+        ok = keypool_take(i < 2 ? paths[0] : paths[1], bits, p[i], q[i], &stats);
+        mpz_mul(n, p[i], q[i]);
+        ok = ok && mpz_sizeinbase(n, 2) == bits && mpz_probab_prime_p(p[i], 25)
+             && mpz_probab_prime_p(q[i], 25);
+    }
+    ok = ok && mpz_cmp(p[0], p[1]) != 0 && mpz_cmp(p[0], p[2]) != 0 && mpz_cmp(p[1], p[2]) != 0;
+    ok = ok && !keypool_take(paths[0], bits, n, n, &stats) && stats.hits == 2 && stats.misses == 1
+         && stats.entries == 0;
+
+    // each take cut one record off, so only the header is left
+    struct stat st;
+    ok = ok && stat(paths[0], &st) == 0 && st.st_size == KEYPOOL_HEAD;
+
+    remove(paths[0]);
+    remove(paths[1]);
+    mpz_clears(p[0], q[0], p[1], q[1], p[2], q[2], n, NULL);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    uint64_t ops = 10000;
+    uint64_t maxbits = 512;
+    uint64_t trips = 50;
+    uint64_t seed = 2022;
+    uint32_t threads = 4;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': print_help(); return 0;
+        case 'v': verbose = true; break;
+        case 'n': ops = strtoull(optarg, NULL, 10); break;
+        case 'b': maxbits = strtoull(optarg, NULL, 10); break;
+        case 'r': trips = strtoull(optarg, NULL, 10); break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 't': threads = (uint32_t) strtoul(optarg, NULL, 10); break;
+        default: print_help(); return 0;
+        }
+    }
+    if (maxbits < GMP_NUMB_BITS) {
+        maxbits = GMP_NUMB_BITS;
+    }
+
+    randstate_init(seed);
+    tune_defaults(&tune, maxbits);
+    tune.threads = 1; // the global functions stay serial, the trips pick their own threads
+
+    for (uint64_t i = 0; i < ops; i += 1) {
+        check_ops(maxbits);
+    }
+    printf("ops = %" PRIu64 " operand sets up to %" PRIu64 " bits, %" PRIu64 " mismatches\n", ops,
+        maxbits, failures);
+
+    uint64_t before = failures;
+    for (uint64_t i = 0; i < trips; i += 1) {
+        check_trip(maxbits, threads);
+    }
+    printf("trips = %" PRIu64 " round trips at 1 and %" PRIu32 " threads, %" PRIu64 " mismatches\n",
+        trips, threads, failures - before);
+
+    before = failures;
+    for (uint64_t i = 0; i < trips; i += 1) {
+        check_keygen(maxbits, threads);
+    }
+    printf("keys = %" PRIu64 " seeded keys at 1 and %" PRIu32 " threads, %" PRIu64 " mismatches\n",
+        trips, threads, failures - before);
+
+    before = failures;
+    for (uint64_t i = 0; i < trips; i += 1) {
+        check_multi(maxbits);
+    }
+    printf("multi = %" PRIu64 " two key files with one digit changed, %" PRIu64 " mismatches\n",
+        trips, failures - before);
+
+    before = failures;
+    if (!check_pool(128, seed)) {
+        failures += 1;
+        fprintf(stderr, "keypool mismatch\n");
+    }
+    printf("pool = 3 pairs from fresh refills under one seed, %" PRIu64 " mismatches\n",
+        failures - before);
+
+    randstate_clear();
+    return failures ? 1 : 0;
+}
@@ -12,8 +12,10 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "tune.h"
+#include "arena.h"
 
-#define OPTIONS "hvi:o:n:"
+#define OPTIONS "hvamfzi:o:n:c:"
 
 // helper function to print out help command
 void print_help() {
@@ -22,14 +24,66 @@ void print_help() {
     printf("   Encrypted data is decrypted by the decrypt program.\n");
     printf("\n");
     printf("USAGE\n");
-    printf("   ./encrypt [-hv] [-i infile] [-o outfile] -n pubkey\n");
+    printf("   ./encrypt [-hvamfz] [-i infile] [-o outfile] [-c ckptfile] -n pubkey [-n pubkey ...]\n");
     printf("\n");
     printf("OPTIONS\n");
     printf("   -h              Display program help and usage.\n");
     printf("   -v              Display verbose program output.\n");
+    printf("   -m              Pool GMP memory in a zeroizing arena.\n");
+    printf("   -a              Calibrate settings for this key size, save to " TUNE_PROFILE
+           " and exit.\n");
+    printf("   -f              Fixed width blocks so decrypt -r can seek (seekable file).\n");
+    printf("   -z              Compress the input before encrypting it (fewer blocks).\n");
     printf("   -i infile       Input file of data to encrypt (default: stdin).\n");
     printf("   -o outfile      Output file for encrypted data (default: stdout).\n");
-    printf("   -n pbfile       Public key file (default: rsa.pub).\n");
+    printf("   -n pbfile       Public key file (default: rsa.pub), repeat for one file\n");
+    printf("                   every listed key can decrypt.\n");
+    printf("   -c ckptfile     Checkpoint progress to ckptfile and resume from it.\n");
+}
+
+// read and verify the keys after the first (n, e), then encrypt once for all of them
+static bool encrypt_multi(
+    FILE *infile, FILE *outfile, char *pubpaths[], size_t npub, mpz_t n, mpz_t e, bool verbose) {
+    mpz_t *ns = (mpz_t *) malloc(npub * sizeof(mpz_t));
+    mpz_t *es = (mpz_t *) malloc(npub * sizeof(mpz_t));
+    mpz_t s, m;
+    mpz_inits(s, m, NULL);
+    char username[RSA_USER_MAX];
+
+    mpz_init_set(ns[0], n);
+    mpz_init_set(es[0], e);
+    size_t read = 1;
+    bool ok = true;
+    for (; ok && read < npub; read += 1) {
+        mpz_inits(ns[read], es[read], NULL);
+        FILE *pubfile = fopen(pubpaths[read], "r");
+        if (!pubfile) {
+            fprintf(stderr, "%s: No such file or directory\n", pubpaths[read]);
+            ok = false;
+            continue;
+        }
+        rsa_read_pub(ns[read], es[read], s, username, pubfile);
+        fclose(pubfile);
+
+        // each key has to carry a valid signature of its user, like the first
+        mpz_set_str(m, username, 62);
+        if (rsa_verify(m, s, es[read], ns[read]) == false) {
+            fprintf(stderr, "%s: invalid singature.\n", pubpaths[read]);
+            ok = false;
+        } else if (verbose == true) {
+            gmp_printf("user = %s\n", username);
+        }
+    }
+
+    ok = ok && rsa_encrypt_multi(infile, outfile, npub, ns, es);
+
+    for (size_t i = 0; i < read; i += 1) {
+        mpz_clears(ns[i], es[i], NULL);
+    }
+    free(ns);
+    free(es);
+    mpz_clears(s, m, NULL);
+    return ok;
 }
 
 // main function
@@ -43,10 +97,17 @@ int main(int argc, char **argv) {
 
     bool verbose = false;
     bool readpub = true;
+    bool autotune = false;
+    bool arena = false;
+    char *outpath = NULL; // opened after the options, see -c
+    char *ckpath = NULL;
+    bool seekable = false;
+    bool compress = false;
+    char *pubpaths[RSA_MAX_RECIPIENTS]; // every -n, the first is opened as pubfile
+    size_t npub = 0;
 
-    // init mpz_t var
+    // mpz_t variables, set up once the arena (-m) is in place
     mpz_t n, e, s, m;
-    mpz_inits(n, e, s, m, NULL);
 
     // user input/help manual
     int opt = 0;
@@ -57,51 +118,58 @@ int main(int argc, char **argv) {
             return 0;
             break;
         case 'v': verbose = true; break;
+        case 'a': autotune = true; break; // calibrate instead of encrypting
+        case 'm': arena = true; break; // pool GMP memory
+        case 'f': seekable = true; break; // fixed width blocks for decrypt -r
+        case 'z': compress = true; break; // LZ before the block loop
         case 'i': // file to read from (default is stdin)
             infile = fopen(optarg, "r");
             // if there is no file to read (print error and close necessary file)
             if (!infile) {
                 fprintf(stderr, "Error: unable to read file.\n");
-                fclose(infile);
                 if (outfile) {
                     fclose(outfile);
                 }
                 if (pubfile) {
                     fclose(pubfile);
                 }
-                mpz_clears(n, e, s, NULL);
                 return 0;
             }
             break;
         case 'o': // file to output to (default is stdout)
-            outfile = fopen(optarg, "w");
-            if (!outfile) {
-                fprintf(stderr, "Error: unable to write file.\n");
-                fclose(outfile);
+            outpath = optarg;
+            break;
+        case 'c': // checkpoint file for resumable runs
+            ckpath = optarg;
+            break;
+        case 'n':
+            // further keys are read once the first one checks out
+            if (npub == RSA_MAX_RECIPIENTS) {
+                fprintf(stderr, "Error: too many keys.\n");
                 if (infile) {
                     fclose(infile);
                 }
                 if (pubfile) {
                     fclose(pubfile);
                 }
-                mpz_clears(n, e, s, NULL);
                 return 0;
             }
-            break;
-        case 'n':
+            pubpaths[npub] = optarg;
+            npub += 1;
+            if (npub > 1) {
+                break;
+            }
             // if a key file was provided
             readpub = false; // disable the the default key file
             pubfile = fopen(optarg, "r");
             if (!pubfile) {
                 fprintf(stderr, "Error: unable to read file.\n");
-                fclose(pubfile);
                 if (infile) {
                     fclose(infile);
                 }
                 if (outfile) {
                     fclose(outfile);
                 }
-                mpz_clears(n, e, s, NULL);
                 return 0;
             }
             break;
@@ -112,6 +180,47 @@ int main(int argc, char **argv) {
         }
     }
 
+    // route GMP through the arena before any number is made, sized once the key is read
+    if (arena) {
+        arena_install(0, true);
+    }
+    mpz_inits(n, e, s, m, NULL);
+
+    // resuming needs to seek both files, checked before -o is opened (and truncated)
+    if (ckpath && (infile == stdin || !outpath)) {
+        fprintf(stderr, "Error: -c needs -i and -o files.\n");
+        if (infile) {
+            fclose(infile);
+        }
+        if (pubfile) {
+            fclose(pubfile);
+        }
+        mpz_clears(n, e, s, NULL);
+        return 0;
+    }
+
+    // open the output now that we know whether we are resuming
+    // a resumed run keeps the output its checkpoint covers
+    if (outpath) {
+        rsa_ckpt_t ckpt;
+        bool resume = ckpath && rsa_ckpt_read(&ckpt, ckpath);
+        outfile = fopen(outpath, resume ? "r+" : "w+"); // read back for the checkpoint head
+        if (!outfile) {
+            fprintf(stderr, "Error: unable to write file.\n");
+            if (infile) {
+                fclose(infile);
+            }
+            if (pubfile) {
+                fclose(pubfile);
+            }
+            mpz_clears(n, e, s, NULL);
+            return 0;
+        }
+        if (resume && verbose) {
+            printf("resuming at block %" PRIu64 "\n", ckpt.blocks);
+        }
+    }
+
     // if no user input key file was inputted, open default rsa.pub
     if (readpub == true) {
         pubfile = fopen("rsa.pub", "r");
@@ -129,7 +238,7 @@ int main(int argc, char **argv) {
         }
     }
     // username var (we need to hard this, since we don't know the size)
-    char username[1024];
+    char username[RSA_USER_MAX];
 
     // read public key from opened public key file
     rsa_read_pub(n, e, s, username, pubfile);
@@ -149,6 +258,31 @@ int main(int argc, char **argv) {
         gmp_printf("e (%d bits) = %Zd\n", numbits, e);
     }
 
+    // load the saved settings for this key size, defaults if there are none
+    uint64_t keybits = mpz_sizeinbase(n, 2);
+    if (arena) {
+        arena_size(keybits);
+    }
+    tune_defaults(&tune, keybits);
+    tune_load(&tune, keybits, TUNE_PROFILE);
+
+    // autotune mode: calibrate for this key size, save the profile and exit
+    if (autotune) {
+        tune_calibrate(&tune, keybits, verbose);
+        if (!tune_save(&tune, TUNE_PROFILE)) {
+            fprintf(stderr, "Error: unable to write " TUNE_PROFILE ".\n");
+        }
+        tune_print(&tune, stdout);
+        fclose(infile);
+        fclose(outfile);
+        fclose(pubfile);
+        mpz_clears(n, e, s, m, NULL);
+        return 0;
+    }
+    if (verbose == true) {
+        tune_print(&tune, stdout);
+    }
+
     // convert the user name into an mpz_t (like keygen)
     mpz_set_str(m, username, 62);
 
@@ -163,8 +297,34 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    //encrypt the file using rsa_encrypt_file()
-    rsa_encrypt_file(infile, outfile, n, e);
+    if (npub > 1) {
+        // several keys: check every signature, then wrap the file once for all of them
+        if (ckpath || seekable || compress) {
+            fprintf(stderr, "Error: -c, -f and -z take a single -n key.\n");
+        } else if (!encrypt_multi(infile, outfile, pubpaths, npub, n, e, verbose)) {
+            fprintf(stderr, "Error: unable to encrypt for every key.\n");
+        }
+    } else {
+        //encrypt the file using rsa_encrypt_file_opts() (no checkpoints without -c)
+        rsa_file_opts_t opts = { ckpath, seekable, compress, 0, 0, false };
+        if (compress && (ckpath || seekable)) {
+            fprintf(stderr, "Error: -z does not go with -c or -f.\n");
+        } else if (!rsa_encrypt_file_opts(infile, outfile, n, e, &opts)) {
+            if (opts.ckpt_failed) {
+                fprintf(stderr, "Error: checkpoint %s does not match this run or cannot be written.\n",
+                    ckpath);
+            } else {
+                fprintf(stderr, "Error: unable to encrypt this file.\n");
+            }
+        } else if (compress && verbose) {
+            printf("lz = %" PRIu64 " bytes in, %" PRIu64 " encrypted (%.2fx)\n", opts.raw,
+                opts.packed, opts.packed ? (double) opts.raw / opts.packed : 0.0);
+        }
+    }
+    if (arena && verbose) {
+        arena_print(stdout);
+    }
+
     fclose(infile);
     fclose(outfile);
     fclose(pubfile);
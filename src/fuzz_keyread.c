@@ -0,0 +1,36 @@
+// libFuzzer target for the key file parsers rsa_read_pub, rsa_read_priv and rsa_read_crt
+// build with make fuzz, run with ./fuzz_keyread [corpus dir]
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <gmp.h>
+
+#include "rsa.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) {
+        return 0; // fmemopen wants a non-empty buffer
+    }
+    FILE *keyfile = fmemopen((void *) data, size, "r");
+    if (!keyfile) {
+        return 0;
+    }
+
+    mpz_t n, e, s, d;
+    mpz_inits(n, e, s, d, NULL);
+    char username[RSA_USER_MAX];
+
+    // the same bytes as a public key, then as a private key
+    rsa_read_pub(n, e, s, username, keyfile);
+    rewind(keyfile);
+    rsa_read_priv(n, d, keyfile);
+    rsa_crt_t crt;
+    rsa_crt_init(&crt);
+    rsa_read_crt(&crt, n, d, keyfile);
+
+    rsa_crt_clear(&crt);
+    fclose(keyfile);
+    mpz_clears(n, e, s, d, NULL);
+    return 0;
+}
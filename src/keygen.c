@@ -13,26 +13,74 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "tune.h"
+#include "arena.h"
+#include "keypool.h"
 
-#define OPTIONS "hvb:i:n:d:s:"
-
-gmp_randstate_t state;
+#define OPTIONS "hvmb:i:n:d:s:p:f:w:k:"
 
 void print_help() {
     printf("SYNOPSIS\n");
     printf("   Generates an RSA public/private key pair.\n");
     printf("\n");
     printf("USAGE\n");
-    printf("   ./keygen [-hv] [-b bits] -n pbfile -d pvfile\n");
+    printf("   ./keygen [-hvm] [-b bits] [-k primes] [-p poolfile] -n pbfile -d pvfile\n");
+    printf("   ./keygen [-v] [-b bits] [-p poolfile] [-w secs] -f size\n");
     printf("\n");
     printf("OPTIONS\n");
     printf("   -h              Display program help and usage.\n");
     printf("   -v              Display verbose program output.\n");
+    printf("   -m              Pool GMP memory in a zeroizing arena.\n");
     printf("   -b bits         Minimum bits needed for public key n (default: 256).\n");
     printf("   -i confidence   Miller-Rabin iterations for testing primes (default: 50).\n");
+    printf("   -k primes       Primes in n, 2 to %d (default: 2).\n", RSA_MAX_PRIMES);
     printf("   -n pbfile       Public key file (default: rsa.pub).\n");
     printf("   -d pvfile       Private key file (default: rsa.priv).\n");
-    printf("   -s seed         Random seed for testing.\n");
+    printf("   -s seed         Random seed for testing (default: from getrandom).\n");
+    printf("   -p poolfile     Take the primes from a pre-generated pool, generating\n");
+    printf("                   them when it is empty (ignored with -s).\n");
+    printf("   -f size         Fill the pool (default: " KEYPOOL_FILE ") up to size pairs\n");
+    printf("                   for -b bits at low priority and exit (not with -s).\n");
+    printf("   -w secs         With -f, keep running and top the pool up every secs.\n");
+}
+
+// seconds on a monotonic clock
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// top the pool up to size prime pairs for bits wide keys on idle cores
+// stops early when another refill fills it first
+// with a watch interval it stays up and tops the pool up again every watch seconds
+static void pool_fill(const char *poolpath, uint64_t bits, uint64_t iters, uint64_t size, uint64_t watch) {
+    // lowest priority, key issuance and everything else on the host come first
+    if (nice(19) == -1) {
+        fprintf(stderr, "Warning: unable to lower priority.\n");
+    }
+
+    bool first = true;
+    do {
+        if (!first) {
+            sleep((unsigned) watch);
+        }
+        uint64_t made = 0;
+        double start = now();
+        if (!keypool_fill(poolpath, bits, iters, size, &made)) {
+            fprintf(stderr, "Error: unable to get random seed.\n");
+            return;
+        }
+        double elapsed = now() - start;
+
+        // a watching refill only reports the rounds that did something
+        if (first || made > 0) {
+            printf("refill = %" PRIu64 " pairs in %.2f s (%.2f pairs/s), %" PRIu64 " in pool\n",
+                made, elapsed, elapsed > 0 ? made / elapsed : 0.0, keypool_count(poolpath, bits));
+            fflush(stdout);
+        }
+        first = false;
+    } while (watch > 0);
 }
 
 int main(int argc, char **argv) {
@@ -44,14 +92,20 @@ int main(int argc, char **argv) {
     FILE *pubfile = NULL;
     FILE *prifile = NULL;
     bool verbose = false;
+    bool arena = false;
 
     uint64_t MRiters = 50; // default Miller Rabin iterations
-    uint64_t seed = time(NULL);
+    uint64_t seed = 0;
+    bool seeded = false; // -s given, otherwise seed from the kernel
+    char *poolpath = NULL; // draw primes from here when set
+    uint64_t fill = 0; // refill the pool to this many pairs instead of making a key
+    uint64_t watch = 0; // with -f, seconds between refills, 0 to fill once
     uint64_t bits = 256; // default bits
+    uint64_t primes = 2; // primes in n
 
-    // mpz_t variable init and set up
+    // mpz_t variables, set up once the arena (-m) is in place
     mpz_t p, q, n, e, d, m, s;
-    mpz_inits(p, q, n, e, d, m, s, NULL);
+    rsa_crt_t crt; // the primes, kept in the private key for CRT
 
     // username var
     char *username[sizeof(getenv("USER"))];
@@ -66,6 +120,7 @@ int main(int argc, char **argv) {
             break;
             // verbose printing
         case 'v': verbose = true; break;
+        case 'm': arena = true; break; // pool GMP memory
         case 'b':
             bits = atoi(optarg);
             break; // min is 256
@@ -75,7 +130,12 @@ int main(int argc, char **argv) {
         case 'd': privpath = optarg; break; // for private key file
         case 's': // soecifies a random seed
             seed = atoi(optarg);
+            seeded = true;
             break;
+        case 'p': poolpath = optarg; break; // pre-generated primes
+        case 'f': fill = strtoull(optarg, NULL, 10); break; // refill mode
+        case 'w': watch = strtoull(optarg, NULL, 10); break; // standing refill
+        case 'k': primes = strtoull(optarg, NULL, 10); break; // multi-prime
         default:
             print_help();
             return 0;
@@ -83,11 +143,53 @@ int main(int argc, char **argv) {
         }
     }
 
+    // route GMP through the arena before any number is made, every block it frees
+    // then came from the arena at class size
+    if (arena) {
+        arena_install(bits, true);
+    }
+    mpz_inits(p, q, n, e, d, m, s, NULL);
+    rsa_crt_init(&crt);
+
+    // every extra prime needs some width, and 32 bits a prime keeps the top bits pinned
+    // meaningful, two primes split -b as they always did
+    if (primes < 2 || primes > RSA_MAX_PRIMES) {
+        fprintf(stderr, "Error: -k takes 2 to %d primes.\n", RSA_MAX_PRIMES);
+        rsa_crt_clear(&crt);
+        mpz_clears(p, q, n, e, d, m, s, NULL);
+        return 0;
+    }
+    if (primes > 2 && bits < 32 * primes) {
+        fprintf(stderr, "Error: -b has to be at least %" PRIu64 " for -k %" PRIu64 ".\n",
+            32 * primes, primes);
+        rsa_crt_clear(&crt);
+        mpz_clears(p, q, n, e, d, m, s, NULL);
+        return 0;
+    }
+
+    // refill mode: no key files are touched, and the primes always come from the kernel
+    // since a seeded pool would hand out keys anyone with the seed can make
+    if (fill > 0) {
+        if (seeded) {
+            fprintf(stderr, "Error: -f does not take -s, pool primes are never seeded.\n");
+            rsa_crt_clear(&crt);
+            mpz_clears(p, q, n, e, d, m, s, NULL);
+            return 0;
+        }
+        tune_defaults(&tune, bits);
+        tune_load(&tune, bits, TUNE_PROFILE);
+        pool_fill(poolpath ? poolpath : KEYPOOL_FILE, bits, MRiters, fill, watch);
+        rsa_crt_clear(&crt);
+        mpz_clears(p, q, n, e, d, m, s, NULL);
+        return 0;
+    }
+
     pubfile = fopen(pubpath, "w");
     if (!pubfile) {
         fprintf(stderr, "Error: unable to write into file.\n");
         fclose(pubfile);
         fclose(prifile);
+        rsa_crt_clear(&crt);
         mpz_clears(p, q, n, e, d, m, s, NULL);
         return 0;
     }
@@ -97,6 +199,7 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Error: unable to write into file.\n");
         fclose(pubfile);
         fclose(prifile);
+        rsa_crt_clear(&crt);
         mpz_clears(p, q, n, e, d, m, s, NULL);
         return 0;
     }
@@ -105,15 +208,40 @@ int main(int argc, char **argv) {
     int number = fileno(prifile);
     fchmod(number, 0600);
 
-    // init random seed using set seed
-    randstate_init(seed);
+    // init random seed using set seed (reproducible), or from getrandom
+    if (seeded) {
+        randstate_init(seed);
+    } else if (!randstate_init_os()) {
+        fprintf(stderr, "Error: unable to get random seed.\n");
+        fclose(pubfile);
+        fclose(prifile);
+        rsa_crt_clear(&crt);
+        mpz_clears(p, q, n, e, d, m, s, NULL);
+        return 0;
+    }
+
+    // use the saved settings for this key size when there are any
+    tune_defaults(&tune, bits);
+    tune_load(&tune, bits, TUNE_PROFILE);
 
     // make public key (p, q is prime num) n is product of pq
     // and e is the public exponent
-    rsa_make_pub(p, q, n, e, bits, MRiters);
+    // with -p the primes come from the pool, a seeded run always searches so it repeats
+    // the pool only holds pairs, so -k 3 and up always search too
+    keypool_stats_t poolstats = { 0, 0, 0 };
+    bool pooled = poolpath && !seeded && primes == 2
+                  && keypool_take(poolpath, bits, crt.r[0], crt.r[1], verbose ? &poolstats : NULL);
+    if (pooled) {
+        rsa_make_pub_pq(crt.r[0], crt.r[1], n, e);
+        crt.count = 2;
+    } else {
+        rsa_make_pub_crt(&crt, primes, n, e, bits, MRiters);
+    }
+    mpz_set(p, crt.r[0]);
+    mpz_set(q, crt.r[1]);
 
-    // make private key
-    rsa_make_priv(d, e, p, q);
+    // make private key, with each prime's CRT exponent and coefficient
+    rsa_make_priv_crt(d, e, &crt);
 
     // get current user's name as a string
     *username = getenv("USER");
@@ -122,11 +250,12 @@ int main(int argc, char **argv) {
     mpz_set_str(m, *username, 62);
 
     // compute singature of username using rsa_sign
-    rsa_sign(s, m, d, n); // s is signature
+    rsa_sign_crt(s, m, &crt); // s is signature
 
     // write the public and private key into file
     rsa_write_pub(n, e, s, *username, pubfile);
     rsa_write_priv(n, d, prifile);
+    rsa_write_crt(&crt, prifile);
 
     // print all the number
     size_t numbits;
@@ -142,6 +271,11 @@ int main(int argc, char **argv) {
         numbits = mpz_sizeinbase(q, 2);
         gmp_printf("q (%d bits) = %Zd\n", numbits, q);
 
+        for (size_t i = 2; i < crt.count; i += 1) {
+            numbits = mpz_sizeinbase(crt.r[i], 2);
+            gmp_printf("r%zu (%d bits) = %Zd\n", i + 1, numbits, crt.r[i]);
+        }
+
         numbits = mpz_sizeinbase(n, 2);
         gmp_printf("n (%d bits) = %Zd\n", numbits, n);
 
@@ -150,9 +284,19 @@ int main(int argc, char **argv) {
 
         numbits = mpz_sizeinbase(d, 2);
         gmp_printf("d (%d bits) = %Zd\n", numbits, d);
+
+        printf("discarded primes = %" PRIu64 "\n", rsa_discarded);
+        if (poolpath && !seeded) {
+            keypool_print(&poolstats, stdout);
+        }
+    }
+
+    if (arena && verbose) {
+        arena_print(stdout);
     }
 
     // free all the memory
+    rsa_crt_clear(&crt);
     mpz_clears(p, q, n, e, d, m, s, NULL);
     randstate_clear();
     fclose(pubfile);
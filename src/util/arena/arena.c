@@ -0,0 +1,213 @@
+// Size-classed, per-thread arena for GMP limbs, installed with mp_set_memory_functions
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <gmp.h>
+
+#include "arena.h"
+
+// smallest class, big enough to hold the free list link
+#define ARENA_MIN_CLASS 16
+
+// most classes we ever make (16 bytes << 20 is 16 MiB)
+#define ARENA_CLASSES 21
+
+// blocks a thread keeps per class before handing them back to free
+#define ARENA_KEEP 64
+
+// per-thread free lists, the link lives in the freed block itself
+typedef struct block {
+    struct block *next;
+} block_t;
+
+typedef struct {
+    block_t *heads[ARENA_CLASSES];
+    uint32_t counts[ARENA_CLASSES];
+    bool registered; // destructor set up for this thread
+} arena_t;
+
+static _Thread_local arena_t local;
+static pthread_key_t exit_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+// every block is rounded up to its class, but only classes up to max_class
+// are kept on the free lists, so max_class can change at any time
+static size_t max_class = 0;
+static bool pooling = false;
+
+static _Atomic uint64_t n_allocs;
+static _Atomic uint64_t n_reallocs;
+static _Atomic uint64_t n_frees;
+static _Atomic uint64_t n_mallocs;
+static _Atomic uint64_t n_reuses;
+
+// overwrite memory the compiler is not allowed to skip
+static void wipe(void *ptr, size_t size) {
+    volatile uint8_t *p = (volatile uint8_t *) ptr;
+    for (size_t i = 0; i < size; i += 1) {
+        p[i] = 0;
+    }
+}
+
+// class index for size bytes, ARENA_CLASSES when it is bigger than any class
+static uint32_t class_of(size_t size) {
+    if (size > ((size_t) ARENA_MIN_CLASS << (ARENA_CLASSES - 1))) {
+        return ARENA_CLASSES;
+    }
+    uint32_t c = 0;
+    size_t bytes = ARENA_MIN_CLASS;
+    while (bytes < size) {
+        bytes <<= 1;
+        c += 1;
+    }
+    return c;
+}
+
+static size_t class_bytes(uint32_t c) {
+    return (size_t) ARENA_MIN_CLASS << c;
+}
+
+// hand a thread's cached blocks back to free when it exits
+static void drain(void *unused) {
+    (void) unused;
+    for (uint32_t c = 0; c < ARENA_CLASSES; c += 1) {
+        while (local.heads[c]) {
+            block_t *b = local.heads[c];
+            local.heads[c] = b->next;
+            free(b);
+        }
+        local.counts[c] = 0;
+    }
+}
+
+static void make_key(void) {
+    pthread_key_create(&exit_key, drain);
+}
+
+// make sure the exit destructor runs for this thread
+static void register_thread(void) {
+    if (!local.registered) {
+        pthread_once(&key_once, make_key);
+        pthread_setspecific(exit_key, &local);
+        local.registered = true;
+    }
+}
+
+static void *arena_alloc(size_t size) {
+    atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+    uint32_t c = pooling ? class_of(size) : ARENA_CLASSES;
+
+    if (c < ARENA_CLASSES && local.heads[c]) {
+        block_t *b = local.heads[c];
+        local.heads[c] = b->next;
+        local.counts[c] -= 1;
+        atomic_fetch_add_explicit(&n_reuses, 1, memory_order_relaxed);
+        return b;
+    }
+
+    atomic_fetch_add_explicit(&n_mallocs, 1, memory_order_relaxed);
+    void *ptr = malloc(c < ARENA_CLASSES ? class_bytes(c) : size);
+    if (!ptr) {
+        fprintf(stderr, "Error: out of memory.\n");
+        abort();
+    }
+    return ptr;
+}
+
+static void arena_free(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&n_frees, 1, memory_order_relaxed);
+    if (!pooling) {
+        free(ptr);
+        return;
+    }
+
+    // limbs can hold key material, never leave them behind
+    // the block is the class size arena_alloc gave it (see arena_install), and the whole
+    // class is wiped since a realloc within the class may have shrunk size
+    uint32_t c = class_of(size);
+    wipe(ptr, c < ARENA_CLASSES ? class_bytes(c) : size);
+    if (c < ARENA_CLASSES && class_bytes(c) <= max_class && local.counts[c] < ARENA_KEEP) {
+        register_thread();
+        block_t *b = (block_t *) ptr;
+        b->next = local.heads[c];
+        local.heads[c] = b;
+        local.counts[c] += 1;
+        return;
+    }
+    free(ptr);
+}
+
+static void *arena_realloc(void *ptr, size_t old_size, size_t new_size) {
+    atomic_fetch_add_explicit(&n_reallocs, 1, memory_order_relaxed);
+    if (!pooling) {
+        atomic_fetch_add_explicit(&n_mallocs, 1, memory_order_relaxed);
+        void *grown = realloc(ptr, new_size);
+        if (!grown) {
+            fprintf(stderr, "Error: out of memory.\n");
+            abort();
+        }
+        return grown;
+    }
+
+    // still fits the block it already has
+    uint32_t c = class_of(old_size);
+    if (c < ARENA_CLASSES && c == class_of(new_size)) {
+        return ptr;
+    }
+
+    // move it (the allocate and free update the counters), never realloc
+    // in place since that can leave an unwiped copy behind
+    atomic_fetch_sub_explicit(&n_allocs, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&n_frees, 1, memory_order_relaxed);
+    void *moved = arena_alloc(new_size);
+    memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+    arena_free(ptr, old_size);
+    return moved;
+}
+
+// keep free lists for blocks up to a few times the limbs of a bits-bit modulus
+// (products and squares are twice the width, windows keep a table of them)
+void arena_size(uint64_t bits) {
+    size_t limbs = (bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+    size_t largest = 4 * (limbs + 1) * sizeof(mp_limb_t);
+    size_t cap = ARENA_MIN_CLASS;
+    while (cap < largest && cap < class_bytes(ARENA_CLASSES - 1)) {
+        cap <<= 1;
+    }
+    max_class = cap;
+}
+
+// route GMP's allocations through the arena, sized for a bits-bit modulus
+// pooled false only counts, so runs can be compared with and without it
+// must run before the first mpz is initialised: arena_free wipes and caches a block
+// as its whole class, which is only right for blocks arena_alloc made
+void arena_install(uint64_t bits, bool pooled) {
+    arena_size(bits);
+    pooling = pooled;
+    mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+}
+
+// snapshot of the counters
+void arena_stats(arena_stats_t *stats) {
+    stats->allocs = atomic_load(&n_allocs);
+    stats->reallocs = atomic_load(&n_reallocs);
+    stats->frees = atomic_load(&n_frees);
+    stats->mallocs = atomic_load(&n_mallocs);
+    stats->reuses = atomic_load(&n_reuses);
+}
+
+// print the counters
+void arena_print(FILE *outfile) {
+    arena_stats_t stats;
+    arena_stats(&stats);
+    fprintf(outfile,
+        "arena = %" PRIu64 " allocs, %" PRIu64 " reallocs, %" PRIu64 " frees, %" PRIu64
+        " mallocs, %" PRIu64 " reused\n",
+        stats.allocs, stats.reallocs, stats.frees, stats.mallocs, stats.reuses);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// allocation counters kept while the arena is installed
+typedef struct {
+    uint64_t allocs; // GMP allocate calls
+    uint64_t reallocs; // GMP reallocate calls
+    uint64_t frees; // GMP free calls
+    uint64_t mallocs; // calls that reached malloc/realloc
+    uint64_t reuses; // allocations served from a free list
+} arena_stats_t;
+
+void arena_install(uint64_t bits, bool pooled);
+
+void arena_size(uint64_t bits);
+
+void arena_stats(arena_stats_t *stats);
+
+void arena_print(FILE *outfile);
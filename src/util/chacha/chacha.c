@@ -0,0 +1,250 @@
+// ChaCha20 block function and the Poly1305 authenticator
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chacha.h"
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                                        \
+    a += b;                                                                                        \
+    d = ROTL(d ^ a, 16);                                                                           \
+    c += d;                                                                                        \
+    b = ROTL(b ^ c, 12);                                                                           \
+    a += b;                                                                                        \
+    d = ROTL(d ^ a, 8);                                                                            \
+    c += d;                                                                                        \
+    b = ROTL(b ^ c, 7);
+
+// one 64 byte block of keystream for (key, nonce, counter)
+void chacha20_block(const uint32_t key[8], uint64_t nonce, uint64_t counter, uint8_t out[CHACHA_BLOCK]) {
+    uint32_t in[16];
+    in[0] = 0x61707865; // "expand 32-byte k"
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    for (int i = 0; i < 8; i += 1) {
+        in[4 + i] = key[i];
+    }
+    in[12] = (uint32_t) counter;
+    in[13] = (uint32_t) (counter >> 32);
+    in[14] = (uint32_t) nonce;
+    in[15] = (uint32_t) (nonce >> 32);
+
+    uint32_t x[16];
+    for (int i = 0; i < 16; i += 1) {
+        x[i] = in[i];
+    }
+
+    // 10 double rounds: columns then diagonals
+    for (int round = 0; round < 10; round += 1) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    // add the input back and write little endian
+    for (int i = 0; i < 16; i += 1) {
+        uint32_t word = x[i] + in[i];
+        out[4 * i] = (uint8_t) word;
+        out[4 * i + 1] = (uint8_t) (word >> 8);
+        out[4 * i + 2] = (uint8_t) (word >> 16);
+        out[4 * i + 3] = (uint8_t) (word >> 24);
+    }
+}
+
+// xor len bytes of buf with the keystream starting at byte offset of the stream
+// the same call encrypts and decrypts, and any offset can be reached directly
+void chacha20_xor(const uint32_t key[8], uint64_t nonce, uint64_t offset, uint8_t *buf, size_t len) {
+    uint8_t stream[CHACHA_BLOCK];
+    uint64_t counter = offset / CHACHA_BLOCK;
+    size_t skip = (size_t) (offset % CHACHA_BLOCK);
+
+    size_t done = 0;
+    while (done < len) {
+        chacha20_block(key, nonce, counter, stream);
+        for (size_t i = skip; i < CHACHA_BLOCK && done < len; i += 1) {
+            buf[done] ^= stream[i];
+            done += 1;
+        }
+        skip = 0;
+        counter += 1;
+    }
+}
+
+// Poly1305 (RFC 8439), h = (h + block) * r mod 2^130 - 5 in 26-bit limbs
+// so every product fits 64 bits, then tag = h + s mod 2^128
+
+#define POLY_MASK 0x3ffffff
+
+static uint32_t le32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// key is r (clamped) then s, one key per message
+void poly1305_init(poly1305_t *st, const uint8_t key[POLY1305_KEY]) {
+    st->r[0] = le32(key) & 0x3ffffff;
+    st->r[1] = (le32(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (le32(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (le32(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (le32(key + 12) >> 8) & 0x00fffff;
+    for (int i = 0; i < 5; i += 1) {
+        st->h[i] = 0;
+    }
+    for (int i = 0; i < 4; i += 1) {
+        st->pad[i] = le32(key + 16 + 4 * i);
+    }
+    st->used = 0;
+}
+
+// absorb whole 16 byte blocks, hibit is 2^128 (as 1 << 24 in the top limb) for
+// full blocks and 0 for the padded last one
+static void poly1305_blocks(poly1305_t *st, const uint8_t *msg, size_t len, uint32_t hibit) {
+    uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    uint64_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+    while (len >= 16) {
+        h0 += le32(msg) & POLY_MASK;
+        h1 += (le32(msg + 3) >> 2) & POLY_MASK;
+        h2 += (le32(msg + 6) >> 4) & POLY_MASK;
+        h3 += (le32(msg + 9) >> 6) & POLY_MASK;
+        h4 += (le32(msg + 12) >> 8) | hibit;
+
+        uint64_t d0 = h0 * r0 + h1 * s4 + h2 * s3 + h3 * s2 + h4 * s1;
+        uint64_t d1 = h0 * r1 + h1 * r0 + h2 * s4 + h3 * s3 + h4 * s2;
+        uint64_t d2 = h0 * r2 + h1 * r1 + h2 * r0 + h3 * s4 + h4 * s3;
+        uint64_t d3 = h0 * r3 + h1 * r2 + h2 * r1 + h3 * r0 + h4 * s4;
+        uint64_t d4 = h0 * r4 + h1 * r3 + h2 * r2 + h3 * r1 + h4 * r0;
+
+        // carry through the limbs, the part past 2^130 comes back times 5
+        uint64_t c = d0 >> 26;
+        h0 = d0 & POLY_MASK;
+        d1 += c;
+        c = d1 >> 26;
+        h1 = d1 & POLY_MASK;
+        d2 += c;
+        c = d2 >> 26;
+        h2 = d2 & POLY_MASK;
+        d3 += c;
+        c = d3 >> 26;
+        h3 = d3 & POLY_MASK;
+        d4 += c;
+        c = d4 >> 26;
+        h4 = d4 & POLY_MASK;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= POLY_MASK;
+        h1 += c;
+
+        msg += 16;
+        len -= 16;
+    }
+
+    st->h[0] = (uint32_t) h0;
+    st->h[1] = (uint32_t) h1;
+    st->h[2] = (uint32_t) h2;
+    st->h[3] = (uint32_t) h3;
+    st->h[4] = (uint32_t) h4;
+}
+
+void poly1305_update(poly1305_t *st, const uint8_t *msg, size_t len) {
+    // finish a block started by an earlier call
+    if (st->used > 0) {
+        size_t take = (16 - st->used < len) ? 16 - st->used : len;
+        for (size_t i = 0; i < take; i += 1) {
+            st->buf[st->used + i] = msg[i];
+        }
+        st->used += take;
+        msg += take;
+        len -= take;
+        if (st->used < 16) {
+            return;
+        }
+        poly1305_blocks(st, st->buf, 16, 1 << 24);
+        st->used = 0;
+    }
+
+    size_t whole = len & ~(size_t) 15;
+    poly1305_blocks(st, msg, whole, 1 << 24);
+    for (size_t i = whole; i < len; i += 1) {
+        st->buf[st->used] = msg[i];
+        st->used += 1;
+    }
+}
+
+// the 16 byte tag, and the state is wiped
+void poly1305_finish(poly1305_t *st, uint8_t tag[POLY1305_TAG]) {
+    if (st->used > 0) {
+        st->buf[st->used] = 1;
+        for (size_t i = st->used + 1; i < 16; i += 1) {
+            st->buf[i] = 0;
+        }
+        poly1305_blocks(st, st->buf, 16, 0);
+    }
+
+    // fully carry h
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t c = h1 >> 26;
+    h1 &= POLY_MASK;
+    h2 += c;
+    c = h2 >> 26;
+    h2 &= POLY_MASK;
+    h3 += c;
+    c = h3 >> 26;
+    h3 &= POLY_MASK;
+    h4 += c;
+    c = h4 >> 26;
+    h4 &= POLY_MASK;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 &= POLY_MASK;
+    h1 += c;
+
+    // g = h - p, kept when h >= p (no borrow out of the top), without branching
+    uint32_t g0 = h0 + 5;
+    c = g0 >> 26;
+    g0 &= POLY_MASK;
+    uint32_t g1 = h1 + c;
+    c = g1 >> 26;
+    g1 &= POLY_MASK;
+    uint32_t g2 = h2 + c;
+    c = g2 >> 26;
+    g2 &= POLY_MASK;
+    uint32_t g3 = h3 + c;
+    c = g3 >> 26;
+    g3 &= POLY_MASK;
+    uint32_t g4 = h4 + c - (1UL << 26);
+    uint32_t keep = (g4 >> 31) - 1; // all ones when h >= p
+    h0 = (h0 & ~keep) | (g0 & keep);
+    h1 = (h1 & ~keep) | (g1 & keep);
+    h2 = (h2 & ~keep) | (g2 & keep);
+    h3 = (h3 & ~keep) | (g3 & keep);
+    h4 = (h4 & ~keep) | (g4 & keep);
+
+    // tag = h + s mod 2^128, little endian
+    uint32_t w[4];
+    w[0] = h0 | (h1 << 26);
+    w[1] = (h1 >> 6) | (h2 << 20);
+    w[2] = (h2 >> 12) | (h3 << 14);
+    w[3] = (h3 >> 18) | (h4 << 8);
+    uint64_t f = 0;
+    for (int i = 0; i < 4; i += 1) {
+        f = (uint64_t) w[i] + st->pad[i] + (f >> 32);
+        tag[4 * i] = (uint8_t) f;
+        tag[4 * i + 1] = (uint8_t) (f >> 8);
+        tag[4 * i + 2] = (uint8_t) (f >> 16);
+        tag[4 * i + 3] = (uint8_t) (f >> 24);
+    }
+
+    volatile uint8_t *p = (volatile uint8_t *) st;
+    for (size_t i = 0; i < sizeof(poly1305_t); i += 1) {
+        p[i] = 0;
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ChaCha20 block function (Bernstein's original layout: 64-bit block
+// counter, 64-bit nonce), used as the random source and as a keystream,
+// and Poly1305 to authenticate what the keystream encrypts
+
+#define CHACHA_BLOCK 64
+
+void chacha20_block(const uint32_t key[8], uint64_t nonce, uint64_t counter, uint8_t out[CHACHA_BLOCK]);
+
+void chacha20_xor(const uint32_t key[8], uint64_t nonce, uint64_t offset, uint8_t *buf, size_t len);
+
+#define POLY1305_KEY 32
+#define POLY1305_TAG 16
+
+// running Poly1305 state, r and h in 26-bit limbs
+typedef struct {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    uint8_t buf[16]; // bytes of a block not yet absorbed
+    size_t used;
+} poly1305_t;
+
+void poly1305_init(poly1305_t *st, const uint8_t key[POLY1305_KEY]);
+
+void poly1305_update(poly1305_t *st, const uint8_t *msg, size_t len);
+
+void poly1305_finish(poly1305_t *st, uint8_t tag[POLY1305_TAG]);
@@ -0,0 +1,265 @@
+// On-disk reservoir of verified prime pairs, so keygen can issue a key without a prime search
+// the file is a KEYPOOL_HEAD byte "#keypool hits=H misses=M" line, then one KEYPOOL_RECORD
+// byte "bits p q" line (hex primes, space padded) per pair, so a take reads the last record
+// and cuts it off with one ftruncate instead of rewriting the file
+// every access holds an exclusive flock, so a refill and any number of keygens can share it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+#include "keypool.h"
+#include "rsa.h"
+#include "tune.h"
+
+// the reservoir while it is open and locked
+typedef struct {
+    int fd;
+    keypool_stats_t stats;
+    uint64_t count; // records
+} pool_t;
+
+// zero a buffer that held primes, the compiler may not drop the stores
+static void wipe(void *ptr, size_t size) {
+    volatile uint8_t *p = (volatile uint8_t *) ptr;
+    for (size_t i = 0; i < size; i += 1) {
+        p[i] = 0;
+    }
+}
+
+// open (creating it owner-only) and lock the reservoir, then read the header
+static bool pool_open(pool_t *pool, const char *path) {
+    pool->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (pool->fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (flock(pool->fd, LOCK_EX) != 0 || fstat(pool->fd, &st) != 0) {
+        close(pool->fd);
+        return false;
+    }
+
+    pool->stats.hits = 0;
+    pool->stats.misses = 0;
+    pool->stats.entries = 0;
+    pool->count = 0;
+
+    char head[KEYPOOL_HEAD + 1];
+    if (st.st_size >= KEYPOOL_HEAD && pread(pool->fd, head, KEYPOOL_HEAD, 0) == KEYPOOL_HEAD) {
+        head[KEYPOOL_HEAD] = '\0';
+        sscanf(head, "#keypool hits=%" SCNu64 " misses=%" SCNu64, &pool->stats.hits,
+            &pool->stats.misses);
+        pool->count = (uint64_t) (st.st_size - KEYPOOL_HEAD) / KEYPOOL_RECORD;
+    }
+    return true;
+}
+
+// read record i into line (KEYPOOL_RECORD + 1 bytes, NUL ended)
+static bool pool_read(pool_t *pool, uint64_t i, char *line) {
+    off_t at = KEYPOOL_HEAD + (off_t) i * KEYPOOL_RECORD;
+    line[KEYPOOL_RECORD] = '\0';
+    return pread(pool->fd, line, KEYPOOL_RECORD, at) == KEYPOOL_RECORD;
+}
+
+// write record i from line
+static bool pool_write(pool_t *pool, uint64_t i, const char *line) {
+    off_t at = KEYPOOL_HEAD + (off_t) i * KEYPOOL_RECORD;
+    return pwrite(pool->fd, line, KEYPOOL_RECORD, at) == KEYPOOL_RECORD;
+}
+
+// write the header back when it changed, then close the file (which drops the lock)
+static bool pool_close(pool_t *pool, bool changed) {
+    bool ok = true;
+    if (changed) {
+        char head[KEYPOOL_HEAD + 1];
+        memset(head, ' ', KEYPOOL_HEAD);
+        int len = snprintf(head, sizeof(head), "#keypool hits=%" PRIu64 " misses=%" PRIu64,
+            pool->stats.hits, pool->stats.misses);
+        head[len] = ' ';
+        head[KEYPOOL_HEAD - 1] = '\n';
+        ok = pwrite(pool->fd, head, KEYPOOL_HEAD, 0) == KEYPOOL_HEAD && fsync(pool->fd) == 0;
+    }
+    close(pool->fd);
+    return ok;
+}
+
+// pairs in the reservoir for bits, reads every record
+static uint64_t pool_count(pool_t *pool, uint64_t bits) {
+    char line[KEYPOOL_RECORD + 1];
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < pool->count && pool_read(pool, i, line); i += 1) {
+        if (strtoull(line, NULL, 10) == bits) {
+            count += 1;
+        }
+    }
+    wipe(line, sizeof(line));
+    return count;
+}
+
+// take a prime pair for a bits wide modulus out of the reservoir at path
+// counts a hit or a miss, false when there is none for bits
+// newest first, so with one key size in the pool a take is one read and one ftruncate,
+// stats (when not NULL) also get the pairs left, which reads the whole pool
+bool keypool_take(const char *path, uint64_t bits, mpz_t p, mpz_t q, keypool_stats_t *stats) {
+    pool_t pool;
+    if (!pool_open(&pool, path)) {
+        return false;
+    }
+
+    // find the newest record for bits, a record that cannot be read ends the search
+    char line[KEYPOOL_RECORD + 1];
+    uint64_t at = pool.count;
+    uint64_t line_bits = 0;
+    bool hit = false;
+    while (at > 0 && !hit) {
+        at -= 1;
+        if (!pool_read(&pool, at, line)) {
+            break;
+        }
+        hit = strtoull(line, NULL, 10) == bits
+              && gmp_sscanf(line, "%" SCNu64 " %Zx %Zx", &line_bits, p, q) == 3 && line_bits == bits;
+    }
+
+    // the last record moves into the hole so a take never shifts the rest, then the
+    // file loses its last record
+    if (hit && at < pool.count - 1) {
+        hit = pool_read(&pool, pool.count - 1, line) && pool_write(&pool, at, line);
+    }
+    if (hit) {
+        hit = ftruncate(pool.fd, KEYPOOL_HEAD + (off_t) (pool.count - 1) * KEYPOOL_RECORD) == 0;
+    }
+    pool.count -= hit ? 1 : 0;
+    wipe(line, sizeof(line));
+
+    if (hit) {
+        pool.stats.hits += 1;
+    } else {
+        pool.stats.misses += 1;
+    }
+    if (stats) {
+        pool.stats.entries = pool_count(&pool, bits);
+        *stats = pool.stats;
+    }
+    pool_close(&pool, true);
+    return hit;
+}
+
+// pairs for bits in the open pool, counted again only when the file changed since the
+// caller's last look: *records is how many records it had then (UINT64_MAX for never)
+// and *have how many of them were for bits, so one refill reads the pool once
+static uint64_t pool_have(pool_t *pool, uint64_t bits, uint64_t *records, uint64_t *have) {
+    if (pool->count != *records) {
+        *have = pool_count(pool, bits);
+        *records = pool->count;
+    }
+    return *have;
+}
+
+// append a pair for bits unless size of them are there, false when full or on a failed
+// write, *records and *have as pool_have and updated for the new record
+static bool pool_put(const char *path, uint64_t bits, mpz_t p, mpz_t q, uint64_t size,
+    uint64_t *records, uint64_t *have) {
+    char line[KEYPOOL_RECORD + 1];
+    memset(line, ' ', KEYPOOL_RECORD);
+    int len = gmp_snprintf(line, sizeof(line), "%" PRIu64 " %Zx %Zx", bits, p, q);
+    if (len < 0 || len >= KEYPOOL_RECORD) {
+        wipe(line, sizeof(line));
+        return false;
+    }
+    line[len] = ' ';
+    line[KEYPOOL_RECORD - 1] = '\n';
+
+    pool_t pool;
+    bool ok = pool_open(&pool, path);
+    if (ok && pool_have(&pool, bits, records, have) >= size) {
+        pool_close(&pool, false);
+        ok = false;
+    } else if (ok) {
+        // a file with no header yet gets one on close
+        ok = pool_write(&pool, pool.count, line);
+        if (ok) {
+            *records += 1;
+            *have += 1;
+        }
+        ok = pool_close(&pool, true) && ok;
+    }
+    wipe(line, sizeof(line));
+    return ok;
+}
+
+// add a prime pair for a bits wide modulus, false when there are already size of them
+// or the pair does not fit a record
+bool keypool_put(const char *path, uint64_t bits, mpz_t p, mpz_t q, uint64_t size) {
+    uint64_t records = UINT64_MAX;
+    uint64_t have = 0;
+    return pool_put(path, bits, p, q, size, &records, &have);
+}
+
+// top the reservoir at path up to size pairs for a bits wide modulus, *made says how many
+// were added, stops early when another refill fills it first
+// the pool is read once up front and again only if someone else changed it
+// the primes come straight from the prime search (no e or d) in a context the kernel
+// seeds, never from the global state, so a seeded caller cannot put primes anyone could
+// repeat into a shared pool
+bool keypool_fill(const char *path, uint64_t bits, uint64_t iters, uint64_t size, uint64_t *made) {
+    *made = 0;
+    pool_t pool;
+    if (!pool_open(&pool, path)) {
+        return true;
+    }
+    uint64_t records = UINT64_MAX;
+    uint64_t have = 0;
+    pool_have(&pool, bits, &records, &have);
+    pool_close(&pool, false);
+    if (have >= size) {
+        return true;
+    }
+
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, 0);
+    if (!rsa_ctx_seed_os(&ctx)) {
+        rsa_ctx_clear(&ctx);
+        return false;
+    }
+    rsa_ctx_set_tune(&ctx, &tune);
+
+    mpz_t p, q;
+    mpz_inits(p, q, NULL);
+    while (have < size) {
+        rsa_ctx_make_primes(&ctx, p, q, bits, iters);
+        if (!pool_put(path, bits, p, q, size, &records, &have)) {
+            break;
+        }
+        *made += 1;
+    }
+    mpz_clears(p, q, NULL);
+    rsa_ctx_clear(&ctx);
+    return true;
+}
+
+// pairs for a bits wide modulus in the reservoir at path
+uint64_t keypool_count(const char *path, uint64_t bits) {
+    pool_t pool;
+    if (!pool_open(&pool, path)) {
+        return 0;
+    }
+    uint64_t count = pool_count(&pool, bits);
+    pool_close(&pool, false);
+    return count;
+}
+
+// print the hit rate and what is left
+void keypool_print(keypool_stats_t *stats, FILE *outfile) {
+    uint64_t draws = stats->hits + stats->misses;
+    fprintf(outfile,
+        "pool = %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate), %" PRIu64 " left\n",
+        stats->hits, stats->misses, draws ? 100.0 * stats->hits / draws : 0.0, stats->entries);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+// default reservoir file, filled by keygen -f and drawn from by keygen -p
+#define KEYPOOL_FILE "rsa.pool"
+
+// header and record widths in the reservoir file, a record holds the pair for keys of up
+// to about 16000 bits
+#define KEYPOOL_HEAD 64
+#define KEYPOOL_RECORD 4096
+
+// counters kept in the reservoir's header line
+typedef struct {
+    uint64_t hits; // keygen runs served from the reservoir
+    uint64_t misses; // keygen runs that found it empty and generated live
+    uint64_t entries; // prime pairs left for the key size asked about
+} keypool_stats_t;
+
+bool keypool_take(const char *path, uint64_t bits, mpz_t p, mpz_t q, keypool_stats_t *stats);
+
+bool keypool_put(const char *path, uint64_t bits, mpz_t p, mpz_t q, uint64_t size);
+
+uint64_t keypool_count(const char *path, uint64_t bits);
+
+bool keypool_fill(const char *path, uint64_t bits, uint64_t iters, uint64_t size, uint64_t *made);
+
+void keypool_print(keypool_stats_t *stats, FILE *outfile);
@@ -0,0 +1,269 @@
+// LZ77 codec and framed stream for compress-before-encrypt
+// a sequence is a token (literal count << 4 | match length - 4, 15 meaning more follows
+// in 255-continued bytes), the literals, then a 2 byte offset and the match length bytes
+// the last sequence of a frame is literals only
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 0xFFFF
+
+// hash of the 4 bytes at p
+static uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// a length past the 15 that fits in a token, as 255-continued bytes
+static uint8_t *put_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+// one sequence: literals, then a match when mlen is not 0
+static uint8_t *put_seq(uint8_t *op, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen) {
+    size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *op++ = (uint8_t) (((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15));
+    if (nlit >= 15) {
+        op = put_len(op, nlit - 15);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen) {
+        *op++ = (uint8_t) offset;
+        *op++ = (uint8_t) (offset >> 8);
+        if (mcode >= 15) {
+            op = put_len(op, mcode - 15);
+        }
+    }
+    return op;
+}
+
+// pack len (at most LZ_FRAME) bytes of in into out, which has room for LZ_BOUND(len)
+// returns the packed size
+size_t lz_compress(const uint8_t *in, size_t len, uint8_t *out) {
+    uint32_t table[1 << LZ_HASH_BITS]; // position + 1 of the last 4 bytes with each hash
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    const uint8_t *end = in + len;
+    uint8_t *op = out;
+
+    // lengths are compared as integers, ip never points more than one past end
+    while ((size_t) (end - ip) >= LZ_MIN_MATCH) {
+        uint32_t h = lz_hash(ip);
+        size_t cand = table[h];
+        table[h] = (uint32_t) (ip - in) + 1;
+
+        if (cand) {
+            const uint8_t *ref = in + cand - 1;
+            if (ip - ref <= LZ_MAX_OFFSET && memcmp(ref, ip, LZ_MIN_MATCH) == 0) {
+                size_t mlen = LZ_MIN_MATCH;
+                while (mlen < (size_t) (end - ip) && ref[mlen] == ip[mlen]) {
+                    mlen += 1;
+                }
+                op = put_seq(op, anchor, (size_t) (ip - anchor), (size_t) (ip - ref), mlen);
+                ip += mlen;
+                anchor = ip;
+                continue;
+            }
+        }
+        // step faster through data that keeps missing, it is likely incompressible
+        // a step past the end leaves the rest for the literal tail
+        size_t step = 1 + ((size_t) (ip - anchor) >> 6);
+        if (step > (size_t) (end - ip)) {
+            break;
+        }
+        ip += step;
+    }
+
+    if (anchor < end || op == out) {
+        op = put_seq(op, anchor, (size_t) (end - anchor), 0, 0);
+    }
+    return (size_t) (op - out);
+}
+
+// read a 255-continued length, false if it runs off the input
+static bool get_len(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t byte;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        byte = **ip;
+        *ip += 1;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// unpack len bytes of in into exactly raw bytes of out
+// false for anything malformed, it never reads or writes out of bounds
+bool lz_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t raw) {
+    const uint8_t *ip = in;
+    const uint8_t *end = in + len;
+    uint8_t *op = out;
+    uint8_t *oend = out + raw;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !get_len(&ip, end, &nlit)) {
+            return false;
+        }
+        if (nlit > (size_t) (end - ip) || nlit > (size_t) (oend - op)) {
+            return false;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == end) {
+            break; // the last sequence has no match
+        }
+
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 0xF;
+        if (mlen == 15 && !get_len(&ip, end, &mlen)) {
+            return false;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (op - out) || mlen > (size_t) (oend - op)) {
+            return false;
+        }
+
+        // byte at a time, a match may overlap what it copies
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < mlen; i += 1) {
+            op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return op == oend;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i += 1) {
+        p[i] = (uint8_t) (v >> (8 * i));
+    }
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+void lz_reader_init(lz_reader_t *r, FILE *infile) {
+    r->file = infile;
+    r->raw = (uint8_t *) malloc(LZ_FRAME);
+    r->frame = (uint8_t *) malloc(LZ_HEADER + LZ_BOUND(LZ_FRAME));
+    r->len = 0;
+    r->pos = 0;
+    r->in = 0;
+    r->out = 0;
+}
+
+// up to len bytes of the framed stream, short only once the input is used up (like fread)
+size_t lz_read(lz_reader_t *r, uint8_t *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        if (r->pos == r->len) {
+            size_t raw = fread(r->raw, sizeof(uint8_t), LZ_FRAME, r->file);
+            if (raw == 0) {
+                break;
+            }
+            size_t packed = lz_compress(r->raw, raw, r->frame + LZ_HEADER);
+            if (packed >= raw) {
+                memcpy(r->frame + LZ_HEADER, r->raw, raw); // stored, packed == raw says so
+                packed = raw;
+            }
+            put32(r->frame, (uint32_t) raw);
+            put32(r->frame + 4, (uint32_t) packed);
+            r->len = LZ_HEADER + packed;
+            r->pos = 0;
+            r->in += raw;
+            r->out += r->len;
+        }
+        size_t take = (len - done < r->len - r->pos) ? len - done : r->len - r->pos;
+        memcpy(buf + done, r->frame + r->pos, take);
+        r->pos += take;
+        done += take;
+    }
+    return done;
+}
+
+void lz_reader_clear(lz_reader_t *r) {
+    memset(r->raw, 0, LZ_FRAME);
+    free(r->raw);
+    free(r->frame);
+}
+
+void lz_writer_init(lz_writer_t *w, FILE *outfile) {
+    w->file = outfile;
+    w->raw = (uint8_t *) malloc(LZ_FRAME);
+    w->frame = (uint8_t *) malloc(LZ_HEADER + LZ_FRAME);
+    w->len = 0;
+}
+
+// take len more bytes of the framed stream, writing out each frame once it is whole
+// false if the stream is malformed
+bool lz_write(lz_writer_t *w, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        size_t want = LZ_HEADER;
+        if (w->len >= LZ_HEADER) {
+            size_t raw = get32(w->frame);
+            size_t packed = get32(w->frame + 4);
+            if (raw == 0 || raw > LZ_FRAME || packed == 0 || packed > raw) {
+                return false;
+            }
+            want = LZ_HEADER + packed;
+        }
+
+        size_t take = (len < want - w->len) ? len : want - w->len;
+        memcpy(w->frame + w->len, buf, take);
+        w->len += take;
+        buf += take;
+        len -= take;
+
+        if (w->len > LZ_HEADER && w->len == want) {
+            size_t raw = get32(w->frame);
+            size_t packed = want - LZ_HEADER;
+            if (packed == raw) {
+                fwrite(w->frame + LZ_HEADER, sizeof(uint8_t), raw, w->file);
+            } else if (lz_decompress(w->frame + LZ_HEADER, packed, w->raw, raw)) {
+                fwrite(w->raw, sizeof(uint8_t), raw, w->file);
+            } else {
+                return false;
+            }
+            w->len = 0;
+        }
+    }
+    return true;
+}
+
+// true if the stream ended on a frame boundary
+bool lz_writer_finish(lz_writer_t *w) {
+    return w->len == 0;
+}
+
+void lz_writer_clear(lz_writer_t *w) {
+    memset(w->raw, 0, LZ_FRAME);
+    free(w->raw);
+    free(w->frame);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Small LZ77 codec (LZ4-style sequences) and the framed stream the file modes use
+// the stream is frames of "raw length, packed length" (4 bytes each, little endian)
+// then the packed bytes, or the raw bytes when packing did not make them smaller
+
+#define LZ_FRAME (64 * 1024) // raw bytes per frame, so offsets fit in 16 bits
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16) // worst case packed size of n bytes
+#define LZ_HEADER 8 // frame header bytes
+
+// pulls raw bytes from a file and hands out the framed, packed stream
+typedef struct {
+    FILE *file;
+    uint8_t *raw; // one frame of input
+    uint8_t *frame; // header and packed bytes of the current frame
+    size_t len; // frame bytes ready
+    size_t pos; // frame bytes handed out
+    uint64_t in; // raw bytes read so far
+    uint64_t out; // stream bytes made so far
+} lz_reader_t;
+
+// takes the framed stream and writes the unpacked bytes to a file
+typedef struct {
+    FILE *file;
+    uint8_t *raw;
+    uint8_t *frame;
+    size_t len; // frame bytes collected
+} lz_writer_t;
+
+size_t lz_compress(const uint8_t *in, size_t len, uint8_t *out);
+
+bool lz_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t raw);
+
+void lz_reader_init(lz_reader_t *r, FILE *infile);
+
+size_t lz_read(lz_reader_t *r, uint8_t *buf, size_t len);
+
+void lz_reader_clear(lz_reader_t *r);
+
+void lz_writer_init(lz_writer_t *w, FILE *outfile);
+
+bool lz_write(lz_writer_t *w, const uint8_t *buf, size_t len);
+
+bool lz_writer_finish(lz_writer_t *w);
+
+void lz_writer_clear(lz_writer_t *w);
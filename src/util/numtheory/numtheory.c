@@ -3,12 +3,13 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 
 #include "randstate.h"
 #include "numtheory.h"
-
-
-gmp_randstate_t state; // init state here in case
+#include "tune.h"
+#include "wspool.h"
 
 // Greatest common divisor
 void gcd(mpz_t d, mpz_t a, mpz_t b) {
@@ -114,8 +115,68 @@ void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus) {
     mpz_clear(d);
 }
 
-// check if num is prime
+// modular expo using a fixed window of exponent bits
+// precomputes base^0 .. base^(2^window - 1) once, then each window costs
+// window squarings and at most one multiply instead of one per set bit
+void pow_mod_window(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus, uint32_t window) {
+    // a window of 1 is plain square and multiply
+    if (window <= 1) {
+        pow_mod(out, base, exponent, modulus);
+        return;
+    }
+    if (window > POW_MOD_MAX_WINDOW) {
+        window = POW_MOD_MAX_WINDOW;
+    }
+
+    size_t entries = (size_t) 1 << window;
+    mpz_t table[(size_t) 1 << POW_MOD_MAX_WINDOW];
+    mpz_t v;
+    mpz_init(v);
+
+    // table[i] = base^i mod n
+    mpz_init_set_ui(table[0], 1);
+    mpz_init(table[1]);
+    mpz_mod(table[1], base, modulus);
+    for (size_t i = 2; i < entries; i += 1) {
+        mpz_init(table[i]);
+        mpz_mul(table[i], table[i - 1], table[1]);
+        mpz_mod(table[i], table[i], modulus);
+    }
+
+    // walk the exponent from the top, one window at a time
+    size_t bits = mpz_sizeinbase(exponent, 2);
+    size_t top = ((bits + window - 1) / window) * window;
+    mpz_set_ui(v, 1);
+    if (mpz_cmp_ui(exponent, 0) > 0) {
+        for (size_t i = top; i > 0; i -= window) {
+            size_t digit = 0;
+            for (uint32_t b = 0; b < window; b += 1) {
+                mpz_mul(v, v, v); // v = v^2 mod n
+                mpz_mod(v, v, modulus);
+                digit = (digit << 1) | mpz_tstbit(exponent, i - 1 - b);
+            }
+            if (digit != 0) {
+                mpz_mul(v, v, table[digit]); // v = v * base^digit mod n
+                mpz_mod(v, v, modulus);
+            }
+        }
+    }
+
+    mpz_set(out, v);
+    for (size_t i = 0; i < entries; i += 1) {
+        mpz_clear(table[i]);
+    }
+    mpz_clear(v);
+}
+
+// check if num is prime (witnesses drawn from the global state)
 bool is_prime(mpz_t n, uint64_t iters) {
+    return is_prime_r(n, iters, &state, tune.window);
+}
+
+// check if num is prime, drawing witnesses from rs so threads can each use their own
+// and exponentiating with the given window width
+bool is_prime_r(mpz_t n, uint64_t iters, rand_src_t *rs, uint32_t window) {
     mpz_t r, a, nminuso, y, j, bound, two; // for r and s value in miller rabin
     mpz_inits(r, a, nminuso, y, j, bound, two, NULL); // init
 
@@ -150,11 +211,11 @@ bool is_prime(mpz_t n, uint64_t iters) {
     // for i to k
     for (uint64_t i = 1; i < iters; i += 1) {
         // choose random a st (2, n - 2)
-        mpz_urandomm(a, state, bound); // (2, n - 2)
+        rand_urandomm(a, rs, bound); // (2, n - 2)
         mpz_add_ui(a, a, 2); // (2, n -1)
 
         // y = power_mod(a,r,n)
-        pow_mod(y, a, r, n);
+        pow_mod_window(y, a, r, n, window);
 
         //if y is not 1
         if ((mpz_cmp_ui(y, 1) != 0) && (mpz_cmp(y, nminuso) != 0)) { // y != 1 and y != n -1
@@ -178,9 +239,111 @@ bool is_prime(mpz_t n, uint64_t iters) {
     return true;
 }
 
-// Generate prime number
+// draw a bits wide odd candidate with the top top bits set
+// two primes with the top two bits set always multiply to exactly pbits + qbits bits,
+// three or four need the top three
+static void draw_candidate(mpz_t p, rand_src_t *rs, uint64_t bits, uint32_t top) {
+    rand_urandomb(p, rs, bits);
+    for (uint32_t i = 1; i <= top && i <= bits; i += 1) {
+        mpz_setbit(p, bits - i);
+    }
+    mpz_setbit(p, 0);
+}
+
+// the source a prime search splits its candidates from, taken from rs with one fixed
+// step so what rs hands out next does not depend on how the search went
+static void search_src(rand_src_t *search, rand_src_t *rs) {
+    rand_split(search, rs, 0);
+    rand_jump(rs, 1);
+}
+
+// one candidate of a parallel prime search round
+typedef struct {
+    mpz_t candidate;
+    rand_src_t rs; // this candidate's own stream, for the candidate and its witnesses
+    uint64_t index; // position in the round, lower wins
+    uint64_t iters;
+    uint32_t window;
+    _Atomic uint64_t *found; // lowest index found prime so far
+} candidate_t;
+
+// Miller-Rabin one candidate, unless a lower candidate already won
+static void test_candidate(void *arg) {
+    candidate_t *c = (candidate_t *) arg;
+    if (atomic_load(c->found) < c->index) {
+        return;
+    }
+    if (is_prime_r(c->candidate, c->iters, &c->rs, c->window)) {
+        uint64_t seen = atomic_load(c->found);
+        while (c->index < seen && !atomic_compare_exchange_weak(c->found, &seen, c->index)) {
+        }
+    }
+}
+
+// Generate prime number, testing rounds of candidates across the pool
+// candidate i is drawn and tested from stream i of the search and the lowest index
+// prime wins, the same one the serial search stops at, so a fixed seed gives the
+// same prime at any thread count
+static void make_prime_pool(mpz_t p, uint64_t bits, uint32_t top, uint64_t iters, rand_src_t *rs,
+    uint32_t window, wspool_t *pool) {
+    uint32_t threads = wspool_size(pool);
+    uint64_t round = 4 * (uint64_t) threads; // keep every worker busy
+    rand_src_t search;
+    search_src(&search, rs);
+
+    // most candidates die on the first witness, a few run all iters, so let the pool balance them
+    candidate_t *cands = (candidate_t *) calloc(round, sizeof(candidate_t));
+    _Atomic uint64_t found = round;
+    for (uint64_t i = 0; i < round; i += 1) {
+        mpz_init(cands[i].candidate);
+        cands[i].index = i;
+        cands[i].iters = iters;
+        cands[i].window = window;
+        cands[i].found = &found;
+    }
+
+    for (uint64_t base = 0; atomic_load(&found) == round; base += round) {
+        for (uint64_t i = 0; i < round; i += 1) {
+            rand_clear(&cands[i].rs); // last round's stream, a no-op on the calloc'd first
+            rand_split(&cands[i].rs, &search, base + i);
+            draw_candidate(cands[i].candidate, &cands[i].rs, bits, top);
+            wspool_submit(pool, test_candidate, &cands[i]);
+        }
+        wspool_wait(pool);
+    }
+    mpz_set(p, cands[atomic_load(&found)].candidate);
+
+    for (uint64_t i = 0; i < round; i += 1) {
+        mpz_clear(cands[i].candidate);
+        rand_clear(&cands[i].rs);
+    }
+    free(cands);
+    rand_clear(&search);
+}
+
+// Generate prime number from the global state with the global settings
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-    do {
-        mpz_urandomb(p, state, bits);
-    } while (!is_prime(p, iters));
+    wspool_t *pool = tune.threads > 1 ? wspool_create(tune.threads) : NULL;
+    make_prime_r(p, bits, 2, iters, &state, tune.window, pool);
+    wspool_delete(&pool);
+}
+
+// Generate prime number from rs with the top top bits set, across pool when it is not NULL
+void make_prime_r(mpz_t p, uint64_t bits, uint32_t top, uint64_t iters, rand_src_t *rs,
+    uint32_t window, wspool_t *pool) {
+    if (pool) {
+        make_prime_pool(p, bits, top, iters, rs, window, pool);
+        return;
+    }
+    // the same candidates in the same order as the pool, one at a time
+    rand_src_t search, cand;
+    search_src(&search, rs);
+    bool prime = false;
+    for (uint64_t i = 0; !prime; i += 1) {
+        rand_split(&cand, &search, i);
+        draw_candidate(p, &cand, bits, top);
+        prime = is_prime_r(p, iters, &cand, window);
+        rand_clear(&cand);
+    }
+    rand_clear(&search);
 }
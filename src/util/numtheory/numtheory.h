@@ -5,12 +5,26 @@
 #include <stdio.h>
 #include <gmp.h>
 
+#include "randstate.h"
+#include "wspool.h"
+
 void gcd(mpz_t d, mpz_t a, mpz_t b);
 
 void mod_inverse(mpz_t i, mpz_t a, mpz_t n);
 
+// largest exponent window pow_mod_window will use (table of 2^8 entries)
+#define POW_MOD_MAX_WINDOW 8
+
 void pow_mod(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus);
 
+void pow_mod_window(mpz_t out, mpz_t base, mpz_t exponent, mpz_t modulus, uint32_t window);
+
 bool is_prime(mpz_t n, uint64_t iters);
 
+bool is_prime_r(mpz_t n, uint64_t iters, rand_src_t *rs, uint32_t window);
+
+// primes are exactly bits wide with the top two bits set
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_prime_r(mpz_t p, uint64_t bits, uint32_t top, uint64_t iters, rand_src_t *rs,
+    uint32_t window, wspool_t *pool);
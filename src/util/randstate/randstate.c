@@ -1,18 +1,203 @@
 // random state interface for RSA library and number theory function
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <gmp.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/random.h>
 
 #include "randstate.h"
+#include "chacha.h"
 
-gmp_randstate_t state; // init state
+rand_src_t state; // init state
 
+// splitmix64 finalizer, spreads a 64-bit value over all bits
+static uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// seed the global state, the same seed always gives the same numbers
 void randstate_init(uint64_t seed) {
-    gmp_randinit_mt(state); // init state with default algorithm
-    gmp_randseed_ui(state, seed); // seeding it
+    rand_init(&state, RAND_CHACHA, seed);
+}
+
+// seed the global state from the kernel
+bool randstate_init_os(void) {
+    return rand_init_os(&state);
 }
 
 void randstate_clear(void) {
-    gmp_randclear(state); // clear the init global state
+    rand_clear(&state); // clear the init global state
+}
+
+// deterministic source of the given kind from a 64-bit seed
+void rand_init(rand_src_t *r, rand_kind_t kind, uint64_t seed) {
+    memset(r, 0, sizeof(rand_src_t));
+    r->kind = kind;
+    if (kind == RAND_MT) {
+        gmp_randinit_mt(r->mt); // init state with default algorithm
+        gmp_randseed_ui(r->mt, seed); // seeding it
+        return;
+    }
+    // stretch the seed over the whole key
+    uint64_t x = seed;
+    for (int i = 0; i < 8; i += 2) {
+        x = mix64(x);
+        r->key[i] = (uint32_t) x;
+        r->key[i + 1] = (uint32_t) (x >> 32);
+    }
+    r->used = CHACHA_BLOCK; // nothing buffered yet
+}
+
+// ChaCha source keyed from getrandom (falls back to /dev/urandom)
+bool rand_init_os(rand_src_t *r) {
+    rand_init(r, RAND_CHACHA, 0);
+
+    uint8_t seed[sizeof(r->key) + sizeof(r->stream)];
+    size_t got = 0;
+    while (got < sizeof(seed)) {
+        ssize_t n = getrandom(seed + got, sizeof(seed) - got, 0);
+        if (n <= 0) {
+            break;
+        }
+        got += (size_t) n;
+    }
+    if (got < sizeof(seed)) {
+        FILE *urandom = fopen("/dev/urandom", "r");
+        if (!urandom) {
+            return false;
+        }
+        got = fread(seed, 1, sizeof(seed), urandom);
+        fclose(urandom);
+        if (got < sizeof(seed)) {
+            return false;
+        }
+    }
+    memcpy(r->key, seed, sizeof(r->key));
+    memcpy(&r->stream, seed + sizeof(r->key), sizeof(r->stream));
+    memset(seed, 0, sizeof(seed));
+    return true;
+}
+
+// an independent source for worker id
+// ChaCha children share the key and get their own stream (nonce), which also
+// depends on where the parent is, so splitting again later gives new streams
+// MT children are seeded from 32 bits drawn from the parent
+// child must be fresh or rand_clear'ed with either backend, it is overwritten as is
+void rand_split(rand_src_t *child, rand_src_t *parent, uint64_t id) {
+    if (parent->kind == RAND_MT) {
+        rand_init(child, RAND_MT, gmp_urandomb_ui(parent->mt, 32) ^ mix64(id));
+        return;
+    }
+    rand_init(child, RAND_CHACHA, 0);
+    memcpy(child->key, parent->key, sizeof(child->key));
+    child->stream = mix64(parent->stream + mix64(parent->counter ^ mix64(id + 1)));
+    child->used = CHACHA_BLOCK;
+}
+
+// skip ahead blocks * 64 bytes in constant time
+void rand_jump(rand_src_t *r, uint64_t blocks) {
+    if (r->kind == RAND_CHACHA) {
+        r->counter += blocks;
+        r->used = CHACHA_BLOCK;
+    }
+}
+
+// wipe the source
+void rand_clear(rand_src_t *r) {
+    if (r->kind == RAND_MT) {
+        gmp_randclear(r->mt);
+    }
+    volatile uint8_t *p = (volatile uint8_t *) r;
+    for (size_t i = 0; i < sizeof(rand_src_t); i += 1) {
+        p[i] = 0;
+    }
+}
+
+// len random bytes
+void rand_bytes(rand_src_t *r, uint8_t *out, size_t len) {
+    if (r->kind == RAND_MT) {
+        // 32 bits per call, the most gmp_urandomb_ui gives on every platform
+        for (size_t i = 0; i < len; i += 4) {
+            unsigned long word = gmp_urandomb_ui(r->mt, 32);
+            for (size_t b = 0; b < 4 && i + b < len; b += 1) {
+                out[i + b] = (uint8_t) (word >> (8 * b));
+            }
+        }
+        return;
+    }
+    while (len > 0) {
+        // whole blocks go straight to the output
+        if (r->used == CHACHA_BLOCK && len >= CHACHA_BLOCK) {
+            chacha20_block(r->key, r->stream, r->counter, out);
+            r->counter += 1;
+            out += CHACHA_BLOCK;
+            len -= CHACHA_BLOCK;
+            continue;
+        }
+        if (r->used == CHACHA_BLOCK) {
+            chacha20_block(r->key, r->stream, r->counter, r->buf);
+            r->counter += 1;
+            r->used = 0;
+        }
+        size_t take = CHACHA_BLOCK - r->used;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(out, r->buf + r->used, take);
+        r->used += take;
+        out += take;
+        len -= take;
+    }
+}
+
+// uniform in [0, 2^bits)
+void rand_urandomb(mpz_t out, rand_src_t *r, mp_bitcnt_t bits) {
+    if (r->kind == RAND_MT) {
+        mpz_urandomb(out, r->mt, bits);
+        return;
+    }
+    size_t len = (bits + 7) / 8;
+    uint8_t stack[512];
+    uint8_t *bytes = len <= sizeof(stack) ? stack : (uint8_t *) malloc(len);
+    rand_bytes(r, bytes, len);
+    mpz_import(out, len, 1, sizeof(uint8_t), 1, 0, bytes);
+    mpz_fdiv_r_2exp(out, out, bits); // drop the extra top bits
+    memset(bytes, 0, len);
+    if (bytes != stack) {
+        free(bytes);
+    }
+}
+
+// uniform in [0, bound) by rejection, fewer than two draws on average
+void rand_urandomm(mpz_t out, rand_src_t *r, mpz_t bound) {
+    if (r->kind == RAND_MT) {
+        mpz_urandomm(out, r->mt, bound);
+        return;
+    }
+    mp_bitcnt_t bits = mpz_sizeinbase(bound, 2);
+    do {
+        rand_urandomb(out, r, bits);
+    } while (mpz_cmp(out, bound) >= 0);
+}
+
+// uniform in [0, bound) for a machine word bound
+uint64_t rand_urandomm_ui(rand_src_t *r, uint64_t bound) {
+    if (r->kind == RAND_MT) {
+        return gmp_urandomm_ui(r->mt, bound);
+    }
+    // reject the top partial range so every value is equally likely
+    uint64_t limit = UINT64_MAX - (UINT64_MAX % bound);
+    uint64_t x;
+    do {
+        uint8_t bytes[8];
+        rand_bytes(r, bytes, sizeof(bytes));
+        memcpy(&x, bytes, sizeof(x));
+    } while (x >= limit);
+    return x % bound;
 }
@@ -1,10 +1,51 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <gmp.h>
 
-extern gmp_randstate_t state;
+#include "chacha.h"
+
+// which generator a random source runs on
+typedef enum {
+    RAND_CHACHA, // ChaCha20 in counter mode (default)
+    RAND_MT, // GMP's Mersenne Twister, the original generator
+} rand_kind_t;
+
+// a random source, one per thread (split them, never share them)
+typedef struct {
+    rand_kind_t kind;
+    uint32_t key[8]; // RAND_CHACHA
+    uint64_t stream; // nonce, different for every split
+    uint64_t counter; // next keystream block
+    uint8_t buf[CHACHA_BLOCK]; // current block
+    size_t used; // bytes of buf handed out
+    gmp_randstate_t mt; // RAND_MT
+} rand_src_t;
+
+extern rand_src_t state;
 
 void randstate_init(uint64_t seed);
 
+bool randstate_init_os(void);
+
 void randstate_clear(void);
+
+void rand_init(rand_src_t *r, rand_kind_t kind, uint64_t seed);
+
+bool rand_init_os(rand_src_t *r);
+
+void rand_split(rand_src_t *child, rand_src_t *parent, uint64_t id);
+
+void rand_jump(rand_src_t *r, uint64_t blocks);
+
+void rand_clear(rand_src_t *r);
+
+void rand_bytes(rand_src_t *r, uint8_t *out, size_t len);
+
+void rand_urandomb(mpz_t out, rand_src_t *r, mp_bitcnt_t bits);
+
+void rand_urandomm(mpz_t out, rand_src_t *r, mpz_t bound);
+
+uint64_t rand_urandomm_ui(rand_src_t *r, uint64_t bound);
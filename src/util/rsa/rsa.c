@@ -6,46 +6,132 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <gmp.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
+#include "chacha.h"
+#include "lz.h"
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "tune.h"
+#include "wspool.h"
 
-// Make public key
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
-    // create and init variables
-    mpz_t p_minus, q_minus, gcd_e, temp_n;
-    mpz_inits(p_minus, q_minus, gcd_e, temp_n, NULL);
-    
-    do {
-
-        // Set up num for upper and lower bound
-        uint64_t lower = (nbits / 4);
-        uint64_t upper = ((3 * nbits) / 4);
+uint64_t rsa_discarded = 0;
 
-        // set up bits bound 
-        uint64_t pbits = lower + (random() % (upper - lower + 1)); // nbits/4,(3 * nbits)/4)
-        uint64_t qbits = nbits - pbits; // the rest into q bits
-
-        // make the prime number
-        make_prime(p, pbits, iters);
-        make_prime(q, qbits, iters);
-        mpz_mul(n, p, q); // n = p * q
+// Euler totient of the product of count primes, (r_0 - 1) * .. * (r_count-1 - 1)
+static void totient(mpz_t phi, mpz_t r[], size_t count) {
+    mpz_t r_minus;
+    mpz_init(r_minus);
+    mpz_set_ui(phi, 1);
+    for (size_t i = 0; i < count; i += 1) {
+        mpz_sub_ui(r_minus, r[i], 1); // r - 1
+        mpz_mul(phi, phi, r_minus);
+    }
+    mpz_clear(r_minus);
+}
 
-    } while (!(mpz_sizeinbase(n, 2) == nbits));
+// pick a random public exponent e coprime to the totient of the primes
+static void make_e_r(mpz_t e, mpz_t r[], size_t count, uint64_t nbits, rand_src_t *rs) {
+    mpz_t gcd_e, temp_n;
+    mpz_inits(gcd_e, temp_n, NULL);
 
     // compute Euler totient function
     // toitent(n) = (p-1)(q-1)
-    mpz_sub_ui(p_minus, p, 1); // p - 1
-    mpz_sub_ui(q_minus, q, 1); // q - 1
-    mpz_mul(temp_n, p_minus, q_minus); // totient
+    totient(temp_n, r, count);
 
     do {
-        mpz_urandomb(e, state, nbits); // generate random num in e
+        rand_urandomb(e, rs, nbits); // generate random num in e
         gcd(gcd_e, e, temp_n); // store into gcd_e
     } while (mpz_cmp_ui(gcd_e, 1) != 0); // while the gcd_e is not the greatest common divisor
 
-    mpz_clears(p_minus, q_minus, gcd_e, temp_n, NULL);
+    mpz_clears(gcd_e, temp_n, NULL);
+}
+
+// Make the primes of n = r_0 * .. * r_count-1 from rs, with the window and (optional) pool given
+// two primes split nbits at random between nbits/4 and 3 nbits/4, more get equal shares
+// the primes have their top two bits set (three for more than two primes) so n is nbits wide
+// on the first try, the loop only stays as a check and counts what it throws away in discarded
+static void make_primes_r(mpz_t r[], size_t count, mpz_t n, uint64_t nbits, uint64_t iters,
+    rand_src_t *rs, uint32_t window, wspool_t *pool, uint64_t *discarded) {
+    uint32_t top = count > 2 ? 3 : 2;
+    bool distinct;
+    do {
+        if (count == 2) {
+            // Set up num for upper and lower bound
+            uint64_t lower = (nbits / 4);
+            uint64_t upper = ((3 * nbits) / 4);
+
+            // set up bits bound 
+            uint64_t pbits = lower + rand_urandomm_ui(rs, upper - lower + 1); // nbits/4,(3 * nbits)/4)
+            uint64_t qbits = nbits - pbits; // the rest into q bits
+
+            // make the prime number
+            make_prime_r(r[0], pbits, top, iters, rs, window, pool);
+            make_prime_r(r[1], qbits, top, iters, rs, window, pool);
+        } else {
+            for (size_t i = 0; i < count; i += 1) {
+                uint64_t rbits = nbits / count + (i < nbits % count ? 1 : 0);
+                make_prime_r(r[i], rbits, top, iters, rs, window, pool);
+            }
+        }
+
+        // n = r_0 * .. * r_count-1, and a repeated prime would make the totient wrong
+        mpz_set(n, r[0]);
+        distinct = true;
+        for (size_t i = 1; i < count; i += 1) {
+            mpz_mul(n, n, r[i]);
+            for (size_t j = 0; j < i; j += 1) {
+                distinct = distinct && mpz_cmp(r[i], r[j]) != 0;
+            }
+        }
+        if (mpz_sizeinbase(n, 2) != nbits || !distinct) {
+            *discarded += count;
+        }
+
+    } while (!(mpz_sizeinbase(n, 2) == nbits && distinct));
+}
+
+// Make public key n = r_0 * .. * r_count-1 and e from rs, the primes as make_primes_r
+static void make_pub_r(mpz_t r[], size_t count, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t iters, rand_src_t *rs, uint32_t window, wspool_t *pool, uint64_t *discarded) {
+    make_primes_r(r, count, n, nbits, iters, rs, window, pool, discarded);
+    make_e_r(e, r, count, nbits, rs);
+    return;
+}
+
+// Make public key from the global state with the global settings
+void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
+    mpz_t r[2];
+    mpz_inits(r[0], r[1], NULL);
+    wspool_t *pool = tune.threads > 1 ? wspool_create(tune.threads) : NULL;
+    make_pub_r(r, 2, n, e, nbits, iters, &state, tune.window, pool, &rsa_discarded);
+    wspool_delete(&pool);
+    mpz_swap(p, r[0]);
+    mpz_swap(q, r[1]);
+    mpz_clears(r[0], r[1], NULL);
+    return;
+}
+
+// Make public key around primes found earlier (a pre-generated pair), from the global state
+void rsa_make_pub_pq(mpz_t p, mpz_t q, mpz_t n, mpz_t e) {
+    mpz_t r[2];
+    mpz_init_set(r[0], p);
+    mpz_init_set(r[1], q);
+    mpz_mul(n, p, q); // n = p * q
+    make_e_r(e, r, 2, mpz_sizeinbase(n, 2), &state);
+    mpz_clears(r[0], r[1], NULL);
+    return;
+}
+
+// Make public key from count primes (2 to RSA_MAX_PRIMES) kept in crt, from the global state
+void rsa_make_pub_crt(rsa_crt_t *crt, size_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
+    wspool_t *pool = tune.threads > 1 ? wspool_create(tune.threads) : NULL;
+    make_pub_r(crt->r, count, n, e, nbits, iters, &state, tune.window, pool, &rsa_discarded);
+    wspool_delete(&pool);
+    crt->count = count;
     return;
 }
 
@@ -64,16 +150,21 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
     return;
 }
 
+// a macro's value as a string literal, for scanf widths
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
 // Read public key 
+// username has room for RSA_USER_MAX characters
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
 
-    // read in n, e, s and user
-
+    // read in n, e, s and user (an empty name if the file stops early)
+    username[0] = '\0';
     gmp_fscanf(pbfile,
         "%Zx\n"
         "%Zx\n"
         "%Zx\n"
-        "%s\n",
+        "%" STR(RSA_USER_LEN) "s\n",
         n, e, s, username);
 
     return;
@@ -95,6 +186,77 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
     return;
 }
 
+// each prime's CRT exponent d mod (r_i - 1) and Garner coefficient
+// t_i = (r_0 * .. * r_i-1)^-1 mod r_i, from the primes in crt and d
+static void crt_coeffs(rsa_crt_t *crt, mpz_t d) {
+    mpz_t r_minus, product;
+    mpz_inits(r_minus, product, NULL);
+    mpz_set_ui(product, 1);
+    for (size_t i = 0; i < crt->count; i += 1) {
+        mpz_sub_ui(r_minus, crt->r[i], 1);
+        mpz_mod(crt->dr[i], d, r_minus); // d mod (r_i - 1)
+        if (i == 0) {
+            mpz_set_ui(crt->t[i], 1);
+        } else {
+            mpz_mod(crt->t[i], product, crt->r[i]);
+            mod_inverse(crt->t[i], crt->t[i], crt->r[i]);
+        }
+        mpz_mul(product, product, crt->r[i]);
+    }
+    mpz_clears(r_minus, product, NULL);
+}
+
+// work out d from the primes in crt, then each prime's CRT exponent and coefficient
+void rsa_make_priv_crt(mpz_t d, mpz_t e, rsa_crt_t *crt) {
+    mpz_t totient_n;
+    mpz_init(totient_n);
+
+    // d = e^-1 mod phi(n), phi(n) = (r_0 - 1) * .. * (r_count-1 - 1)
+    totient(totient_n, crt->r, crt->count);
+    mod_inverse(d, e, totient_n);
+    crt_coeffs(crt, d);
+
+    mpz_clear(totient_n);
+    return;
+}
+
+void rsa_crt_init(rsa_crt_t *crt) {
+    crt->count = 0;
+    for (size_t i = 0; i < RSA_MAX_PRIMES; i += 1) {
+        mpz_inits(crt->r[i], crt->dr[i], crt->t[i], NULL);
+    }
+}
+
+void rsa_crt_clear(rsa_crt_t *crt) {
+    for (size_t i = 0; i < RSA_MAX_PRIMES; i += 1) {
+        mpz_clears(crt->r[i], crt->dr[i], crt->t[i], NULL);
+    }
+    crt->count = 0;
+}
+
+// out = base^d mod n from the factors: one exponentiation per prime with an exponent
+// and modulus a count-th the size, then recombined with Garner's formula
+void rsa_crt_pow(mpz_t out, mpz_t base, rsa_crt_t *crt, uint32_t window) {
+    mpz_t m, m_i, h, product;
+    mpz_inits(m, m_i, h, product, NULL);
+
+    // m = base^d_0 mod r_0
+    pow_mod_window(m, base, crt->dr[0], crt->r[0], window);
+    mpz_set(product, crt->r[0]);
+    for (size_t i = 1; i < crt->count; i += 1) {
+        // m_i = base^d_i mod r_i, then lift m to hold mod r_0 .. r_i
+        pow_mod_window(m_i, base, crt->dr[i], crt->r[i], window);
+        mpz_sub(h, m_i, m);
+        mpz_mul(h, h, crt->t[i]);
+        mpz_mod(h, h, crt->r[i]); // h = (m_i - m) t_i mod r_i
+        mpz_addmul(m, product, h); // m = m + h * r_0 .. r_i-1
+        mpz_mul(product, product, crt->r[i]);
+    }
+    mpz_set(out, m);
+
+    mpz_clears(m, m_i, h, product, NULL);
+}
+
 // Write private RSA key to pvfile
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
 
@@ -114,100 +276,365 @@ void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
     return;
 }
 
+// append the factors to a private key file after n and d:
+// "#crt k" then one "r d_r t" line (hex) per prime, readers that only want n and d stop before it
+void rsa_write_crt(rsa_crt_t *crt, FILE *pvfile) {
+    if (crt->count == 0) {
+        return;
+    }
+    fprintf(pvfile, "#crt %zu\n", crt->count);
+    for (size_t i = 0; i < crt->count; i += 1) {
+        gmp_fprintf(pvfile, "%Zx %Zx %Zx\n", crt->r[i], crt->dr[i], crt->t[i]);
+    }
+    return;
+}
+
+// read the factors that follow n and d (see rsa_write_crt)
+// false, with crt->count 0, when there are none or they do not match n and d,
+// as a wrong factor would quietly give wrong plaintext
+bool rsa_read_crt(rsa_crt_t *crt, mpz_t n, mpz_t d, FILE *pvfile) {
+    size_t count = 0;
+    crt->count = 0;
+    if (fscanf(pvfile, "#crt %zu\n", &count) != 1 || count < 2 || count > RSA_MAX_PRIMES) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i += 1) {
+        if (gmp_fscanf(pvfile, "%Zx %Zx %Zx\n", crt->r[i], crt->dr[i], crt->t[i]) != 3) {
+            return false;
+        }
+    }
+
+    // the primes have to multiply to n, and the rest has to be what d gives
+    rsa_crt_t check;
+    rsa_crt_init(&check);
+    mpz_t product;
+    mpz_init_set_ui(product, 1);
+    bool ok = true;
+    for (size_t i = 0; i < count; i += 1) {
+        ok = ok && mpz_cmp_ui(crt->r[i], 1) > 0;
+        mpz_set(check.r[i], crt->r[i]);
+        mpz_mul(product, product, crt->r[i]);
+    }
+    ok = ok && mpz_cmp(product, n) == 0;
+    if (ok) {
+        check.count = count;
+        crt_coeffs(&check, d);
+        for (size_t i = 0; i < count; i += 1) {
+            ok = ok && mpz_cmp(check.dr[i], crt->dr[i]) == 0 && mpz_cmp(check.t[i], crt->t[i]) == 0;
+        }
+    }
+    mpz_clear(product);
+    rsa_crt_clear(&check);
+
+    crt->count = ok ? count : 0;
+    return ok;
+}
+
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
     // c = m^e (mod n)
-    pow_mod(c, m, e, n);
+    pow_mod_window(c, m, e, n, tune.window);
     return;
 }
 
-// encrypt the file
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
-    mpz_t m, c; // for encrypt
-    mpz_inits(c, m, NULL);
+// one block of a file batch, handed to a pool worker
+typedef struct rsa_slot {
+    uint8_t *block; // block bytes, 0xFF pad byte up front
+    size_t len; // bytes read after the pad (encrypt) or exported (decrypt)
+    mpz_t m, c;
+    mpz_ptr exponent; // key shared by the whole batch
+    mpz_ptr modulus;
+    rsa_crt_t *crt; // factors of modulus (decrypt only), NULL for exponent alone
+    uint32_t window;
+} slot_t;
 
-    // calculate block size k
-    // k = log2(n) - 1 /8
-    size_t k = ((mpz_sizeinbase(n, 2) - 1) / 8);
+// allocate a batch of slots with room for size byte blocks
+static slot_t *slots_create(size_t count, size_t size) {
+    slot_t *slots = (slot_t *) calloc(count, sizeof(slot_t));
+    for (size_t i = 0; i < count; i += 1) {
+        slots[i].block = (uint8_t *) calloc(size, sizeof(uint8_t));
+        mpz_inits(slots[i].m, slots[i].c, NULL);
+    }
+    return slots;
+}
 
-    // allocate memory for block
-    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+static void slots_delete(slot_t *slots, size_t count) {
+    for (size_t i = 0; i < count; i += 1) {
+        mpz_clears(slots[i].m, slots[i].c, NULL);
+        free(slots[i].block);
+    }
+    free(slots);
+}
 
-    // zero out the zero block with 0xFF
-    block[0] = 0xFF;
+// run fn on each slot, across the pool when there is one
+static void slots_run(wspool_t *pool, wspool_fn fn, slot_t *slots, size_t count) {
+    for (size_t i = 0; i < count; i += 1) {
+        if (pool) {
+            wspool_submit(pool, fn, &slots[i]);
+        } else {
+            fn(&slots[i]);
+        }
+    }
+    if (pool) {
+        wspool_wait(pool);
+    }
+}
+
+// pool task: import and encrypt one block
+static void encrypt_slot(void *arg) {
+    slot_t *slot = (slot_t *) arg;
+
+    // using mpz_import(output, number of element, order = 1, size (uint8_t), endian = 1, nails = 0, block)
+    mpz_import(slot->m, slot->len + 1, 1, sizeof(uint8_t), 1, 0, slot->block);
 
-    size_t j = 1;
+    // c = m^e (mod n)
+    pow_mod_window(slot->c, slot->m, slot->exponent, slot->modulus, slot->window);
+}
 
-    while (j > 0) {
-        // use fread (read in a block of file)
-        j = fread(block + 1, sizeof(uint8_t), k - 1, infile);
+// read a checkpoint, false if there is none (or it is unreadable)
+bool rsa_ckpt_read(rsa_ckpt_t *ckpt, const char *path) {
+    FILE *ckfile = fopen(path, "r");
+    if (!ckfile) {
+        return false;
+    }
+    bool ok = fscanf(ckfile,
+                  "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNx64 " %" SCNu32 " %" SCNu64 " %" SCNx64 "\n",
+                  &ckpt->in_offset, &ckpt->out_offset, &ckpt->blocks, &ckpt->key, &ckpt->mode,
+                  &ckpt->in_size, &ckpt->out_head)
+              == 7;
+    fclose(ckfile);
+    return ok;
+}
 
-        // using mpz_import(output, number of element, order = 1, size (uint8_t), endian = 1, nails = 0, block)
-        mpz_import(m, j + 1, 1, sizeof(uint8_t), 1, 0, block);
+// write a checkpoint through a temp file and rename, so a crash never leaves half of one
+bool rsa_ckpt_write(rsa_ckpt_t *ckpt, const char *path) {
+    char temp[4096];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
 
-        // encrypt m
-        rsa_encrypt(c, m, e, n);
+    FILE *ckfile = fopen(temp, "w");
+    if (!ckfile) {
+        return false;
+    }
+    fprintf(ckfile,
+        "%" PRIu64 " %" PRIu64 " %" PRIu64 " %016" PRIx64 " %" PRIu32 " %" PRIu64 " %016" PRIx64 "\n",
+        ckpt->in_offset, ckpt->out_offset, ckpt->blocks, ckpt->key, ckpt->mode, ckpt->in_size,
+        ckpt->out_head);
+    bool ok = fflush(ckfile) == 0 && fsync(fileno(ckfile)) == 0;
+    ok = fclose(ckfile) == 0 && ok;
+    return ok && rename(temp, path) == 0;
+}
 
-        // write to file
-        gmp_fprintf(outfile, "%Zx\n", c);
+// FNV-1a over the bytes of n then the mode, to tell keys and runs apart in a checkpoint
+// n alone names the key, nothing derived from d goes into a checkpoint file
+static uint64_t ckpt_key(mpz_t n, uint32_t mode) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t len = 0;
+    uint8_t *bytes = (uint8_t *) mpz_export(NULL, &len, 1, sizeof(uint8_t), 1, 0, n);
+    for (size_t i = 0; i < len; i += 1) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    for (int i = 0; i < 4; i += 1) {
+        hash = (hash ^ ((mode >> (8 * i)) & 0xFF)) * 0x100000001b3ULL;
     }
 
-    // free memory
-    mpz_clears(c, m, NULL);
-    free(block);
-    return;
+    // the buffer came from GMP's allocator (the arena with -m), so it goes back there
+    void (*gmp_free)(void *, size_t);
+    mp_get_memory_functions(NULL, NULL, &gmp_free);
+    gmp_free(bytes, len);
+    return hash;
 }
 
-// decrypt it using power mod
-void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
-    // m = c^d (mod n)
-    // pow mod (output, base, exponent, modulus)
-    pow_mod(m, c, d, n);
-    return;
+// FNV-1a over the first RSA_CKPT_HEAD bytes of the output (fewer if it is shorter than
+// len), which stay put once written, false if they cannot be read back
+static bool ckpt_head(FILE *outfile, uint64_t len, uint64_t *hash) {
+    uint8_t head[RSA_CKPT_HEAD];
+    size_t want = len < RSA_CKPT_HEAD ? (size_t) len : RSA_CKPT_HEAD;
+    if (pread(fileno(outfile), head, want, 0) != (ssize_t) want) {
+        return false;
+    }
+    *hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < want; i += 1) {
+        *hash = (*hash ^ head[i]) * 0x100000001b3ULL;
+    }
+    return true;
 }
 
-// decrypt the file
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
-    // for storing scanned in file
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
+// pick up from the checkpoint at path: skip input that is done and drop
+// output written after the checkpoint. Starts from zero when there is none
+// the checkpoint has to be for the same key, mode and input size, and the output has to
+// still hold what the checkpoint covers (at least out_offset bytes, the same head),
+// resuming otherwise would splice two different outputs together
+static bool ckpt_resume(rsa_ckpt_t *ckpt, const char *path, FILE *infile, FILE *outfile,
+    mpz_t n, uint32_t mode) {
+    struct stat st;
+    ckpt->in_offset = 0;
+    ckpt->out_offset = 0;
+    ckpt->blocks = 0;
+    ckpt->key = ckpt_key(n, mode);
+    ckpt->mode = mode;
+    ckpt->in_size = fstat(fileno(infile), &st) == 0 ? (uint64_t) st.st_size : 0;
 
-    // use mpz_sizebase(n, 2) credit to Eugene for telling us this
-    // k = log2(n) - 1 /8
-    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    rsa_ckpt_t saved;
+    if (!rsa_ckpt_read(&saved, path)) {
+        return true;
+    }
+    if (saved.key != ckpt->key || saved.mode != ckpt->mode || saved.in_size != ckpt->in_size
+        || saved.in_offset > saved.in_size) {
+        return false;
+    }
+    uint64_t head;
+    fflush(outfile);
+    if (fstat(fileno(outfile), &st) != 0 || (uint64_t) st.st_size < saved.out_offset
+        || !ckpt_head(outfile, saved.out_offset, &head) || head != saved.out_head) {
+        return false;
+    }
+    *ckpt = saved;
+    return fseeko(infile, (off_t) ckpt->in_offset, SEEK_SET) == 0
+           && ftruncate(fileno(outfile), (off_t) ckpt->out_offset) == 0
+           && fseeko(outfile, (off_t) ckpt->out_offset, SEEK_SET) == 0;
+}
+
+// record where both files are after a finished batch, once the output is on disk
+// false if the output or the checkpoint could not be written
+static bool ckpt_save(rsa_ckpt_t *ckpt, const char *path, FILE *infile, FILE *outfile) {
+    if (fflush(outfile) != 0 || fsync(fileno(outfile)) != 0) {
+        return false;
+    }
+    ckpt->in_offset = (uint64_t) ftello(infile);
+    ckpt->out_offset = (uint64_t) ftello(outfile);
+    return ckpt_head(outfile, ckpt->out_offset, &ckpt->out_head) && rsa_ckpt_write(ckpt, path);
+}
 
-    size_t j = 1;
+// write the ciphertext header line
+void rsa_write_header(rsa_header_t *header, FILE *outfile) {
+    if (header->recipients > 0) {
+        fprintf(outfile, "#rsa recipients=%" PRIu32 "\n", header->recipients);
+        return;
+    }
+    fprintf(outfile, "#rsa");
+    if (header->width > 0) {
+        fprintf(outfile, " width=%" PRIu32 " block=%" PRIu32, header->width, header->block);
+    }
+    if (header->codec == RSA_CODEC_LZ) {
+        fprintf(outfile, " codec=lz");
+    }
+    fputc('\n', outfile);
+    return;
+}
 
-    // allocate memory for block
-    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+// read the ciphertext header line if there is one
+// a file without one (variable width blocks) is left untouched and gets a zeroed header
+void rsa_read_header(rsa_header_t *header, FILE *infile) {
+    header->width = 0;
+    header->block = 0;
+    header->recipients = 0;
+    header->codec = RSA_CODEC_NONE;
 
-    // while there are unprocessed bytes in infile (using while loop)
-    // I was originally using a do while, but it was printing an extra loop
-    while (!feof(infile)) {
+    // hex block lines never start with '#'
+    int first = getc(infile);
+    if (first == EOF) {
+        return;
+    }
+    if (first != '#') {
+        ungetc(first, infile);
+        return;
+    }
 
-        // moved here due to scan-build having error
-        j = gmp_fscanf(infile, "%Zx\n", c);
+    char line[1024];
+    char *rest = NULL;
+    if (!fgets(line, sizeof(line), infile)) {
+        return;
+    }
+    for (char *field = strtok_r(line, " \n", &rest); field; field = strtok_r(NULL, " \n", &rest)) {
+        sscanf(field, "width=%" SCNu32, &header->width);
+        sscanf(field, "block=%" SCNu32, &header->block);
+        sscanf(field, "recipients=%" SCNu32, &header->recipients);
+        if (strncmp(field, "codec=", 6) == 0) {
+            header->codec = strcmp(field + 6, "lz") == 0 ? RSA_CODEC_LZ : RSA_CODEC_UNKNOWN;
+        }
+    }
+    return;
+}
 
-        // call rsa_decrypt to decrypt
-        rsa_decrypt(m, c, d, n);
+// encrypt the file
+void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+    rsa_file_opts_t opts = { NULL, false, false, 0, 0, false };
+    rsa_encrypt_file_opts(infile, outfile, n, e, &opts);
+    return;
+}
 
-        // mpz_export(*output, size, order = 1, size, endian = 1, nail = 0, const)
-        mpz_export(block, &j, 1, sizeof(uint8_t), 1, 0, m);
+// encrypt the file with the options in opts, using the global settings
+bool rsa_encrypt_file_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, rsa_file_opts_t *opts) {
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, 0);
+    rsa_ctx_set_tune(&ctx, &tune);
+    rsa_ctx_set_pub(&ctx, n, e);
+    bool ok = rsa_ctx_encrypt_file(&ctx, infile, outfile, opts);
+    rsa_ctx_clear(&ctx);
+    return ok;
+}
 
-        // write to file
-        fwrite((block + 1), sizeof(uint8_t), j - 1, outfile);
+// decrypt it using power mod
+void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
+    // m = c^d (mod n)
+    // pow mod (output, base, exponent, modulus)
+    pow_mod_window(m, c, d, n, tune.window);
+    return;
+}
+
+// pool task: decrypt and export one block
+static void decrypt_slot(void *arg) {
+    slot_t *slot = (slot_t *) arg;
+
+    // m = c^d (mod n)
+    if (slot->crt) {
+        rsa_crt_pow(slot->m, slot->c, slot->crt, slot->window);
+    } else {
+        pow_mod_window(slot->m, slot->c, slot->exponent, slot->modulus, slot->window);
     }
 
-    // free memory
-    mpz_clears(c, m, NULL);
-    free(block);
+    // mpz_export(*output, size, order = 1, size, endian = 1, nail = 0, const)
+    mpz_export(slot->block, &slot->len, 1, sizeof(uint8_t), 1, 0, slot->m);
+}
 
+// decrypt the file
+void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+    rsa_file_opts_t opts = { NULL, false, false, 0, 0, false };
+    rsa_decrypt_file_opts(infile, outfile, n, d, &opts);
     return;
 }
 
+// decrypt the file with the options in opts, using the global settings
+bool rsa_decrypt_file_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_file_opts_t *opts) {
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, 0);
+    rsa_ctx_set_tune(&ctx, &tune);
+    rsa_ctx_set_priv(&ctx, n, d);
+    bool ok = rsa_ctx_decrypt_file(&ctx, infile, outfile, opts);
+    rsa_ctx_clear(&ctx);
+    return ok;
+}
+
+// decrypt a byte range of a seekable ciphertext, using the global settings
+bool rsa_decrypt_range(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, uint64_t offset, uint64_t len) {
+    rsa_ctx_t ctx;
+    rsa_ctx_init(&ctx, 0);
+    rsa_ctx_set_tune(&ctx, &tune);
+    rsa_ctx_set_priv(&ctx, n, d);
+    bool ok = rsa_ctx_decrypt_range(&ctx, infile, outfile, offset, len);
+    rsa_ctx_clear(&ctx);
+    return ok;
+}
+
 // sign the singature
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
     // s = m^d (mod n)
-    pow_mod(s, m, d, n);
+    pow_mod_window(s, m, d, n, tune.window);
+    return;
+}
+
+// sign with the factors of n, the same s as rsa_sign for a fraction of the work
+void rsa_sign_crt(mpz_t s, mpz_t m, rsa_crt_t *crt) {
+    rsa_crt_pow(s, m, crt, tune.window);
     return;
 }
 
@@ -217,7 +644,7 @@ bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
     mpz_init(verifying);
 
     // Verified = s^e (mod n)
-    pow_mod(verifying, s, e, n);
+    pow_mod_window(verifying, s, e, n, tune.window);
 
     // if V(s) == m return true
     if (mpz_cmp(verifying, m) == 0) {
@@ -228,3 +655,784 @@ bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
         return false;
     }
 }
+
+// context: everything one thread needs, so threads with their own contexts
+// never share state. Use a context from one thread at a time.
+
+// set up a context with its own random source seeded from seed
+// (rsa_ctx_seed_os reseeds it from the kernel)
+// single threaded settings for a 2048-bit key until rsa_ctx_set_tune
+void rsa_ctx_init(rsa_ctx_t *ctx, uint64_t seed) {
+    rand_init(&ctx->rs, RAND_CHACHA, seed);
+    tune_defaults(&ctx->tune, 2048);
+    ctx->tune.threads = 1;
+    ctx->pool = NULL;
+    ctx->slots = NULL;
+    ctx->nslots = 0;
+    mpz_inits(ctx->n, ctx->e, ctx->d, NULL);
+    rsa_crt_init(&ctx->crt);
+    ctx->k = 0;
+    ctx->discarded = 0;
+}
+
+// drop the batch scratch (sizes changed or the context is going away)
+static void ctx_drop_slots(rsa_ctx_t *ctx) {
+    if (ctx->slots) {
+        slots_delete(ctx->slots, ctx->nslots);
+    }
+    ctx->slots = NULL;
+    ctx->nslots = 0;
+}
+
+// free everything the context owns
+void rsa_ctx_clear(rsa_ctx_t *ctx) {
+    ctx_drop_slots(ctx);
+    wspool_delete(&ctx->pool);
+    rand_clear(&ctx->rs);
+    mpz_clears(ctx->n, ctx->e, ctx->d, NULL);
+    rsa_crt_clear(&ctx->crt);
+}
+
+// reseed the context's random source from the kernel
+bool rsa_ctx_seed_os(rsa_ctx_t *ctx) {
+    return rand_init_os(&ctx->rs);
+}
+
+// use new settings, remaking the pool and scratch only when they change
+void rsa_ctx_set_tune(rsa_ctx_t *ctx, tune_t *t) {
+    if (ctx->pool && t->threads != ctx->tune.threads) {
+        wspool_delete(&ctx->pool);
+    }
+    if (t->batch != ctx->tune.batch) {
+        ctx_drop_slots(ctx);
+    }
+    ctx->tune = *t;
+}
+
+// a new modulus, scratch sized for the old one goes
+static void ctx_set_modulus(rsa_ctx_t *ctx, mpz_t n) {
+    if (mpz_sizeinbase(n, 2) != mpz_sizeinbase(ctx->n, 2)) {
+        ctx_drop_slots(ctx);
+    }
+    mpz_set(ctx->n, n);
+    // k = log2(n) - 1 /8
+    ctx->k = (mpz_sizeinbase(n, 2) - 1) / 8;
+}
+
+void rsa_ctx_set_pub(rsa_ctx_t *ctx, mpz_t n, mpz_t e) {
+    ctx_set_modulus(ctx, n);
+    mpz_set(ctx->e, e);
+}
+
+// a new private key drops the factors of the old one, rsa_ctx_set_crt adds the new ones
+void rsa_ctx_set_priv(rsa_ctx_t *ctx, mpz_t n, mpz_t d) {
+    ctx_set_modulus(ctx, n);
+    mpz_set(ctx->d, d);
+    ctx->crt.count = 0;
+}
+
+// factors of the private key's n, private operations use CRT from now on
+void rsa_ctx_set_crt(rsa_ctx_t *ctx, rsa_crt_t *crt) {
+    ctx->crt.count = crt->count;
+    for (size_t i = 0; i < crt->count; i += 1) {
+        mpz_set(ctx->crt.r[i], crt->r[i]);
+        mpz_set(ctx->crt.dr[i], crt->dr[i]);
+        mpz_set(ctx->crt.t[i], crt->t[i]);
+    }
+}
+
+// out = in^d mod n with the context's private key, through CRT when it has the factors
+static void ctx_private(rsa_ctx_t *ctx, mpz_t out, mpz_t in) {
+    if (ctx->crt.count > 0) {
+        rsa_crt_pow(out, in, &ctx->crt, ctx->tune.window);
+    } else {
+        pow_mod_window(out, in, ctx->d, ctx->n, ctx->tune.window);
+    }
+}
+
+// the context's workers, made on first use
+static wspool_t *ctx_pool(rsa_ctx_t *ctx) {
+    if (!ctx->pool && ctx->tune.threads > 1) {
+        ctx->pool = wspool_create(ctx->tune.threads);
+    }
+    return ctx->pool;
+}
+
+static size_t ctx_batch(rsa_ctx_t *ctx) {
+    return ctx->tune.batch > 0 ? ctx->tune.batch : 1;
+}
+
+// the batch scratch, set up for exponentiating by exponent mod the context's n,
+// or through crt when it is not NULL and has the factors
+// blocks decrypt to at most the bytes of n (k bytes for the right key)
+static slot_t *ctx_slots(rsa_ctx_t *ctx, mpz_t exponent, rsa_crt_t *crt) {
+    if (!ctx->slots) {
+        ctx->nslots = ctx_batch(ctx);
+        ctx->slots = slots_create(ctx->nslots, (mpz_sizeinbase(ctx->n, 2) + 7) / 8);
+    }
+    for (size_t i = 0; i < ctx->nslots; i += 1) {
+        ctx->slots[i].block[0] = 0xFF; // pad byte, decrypt overwrites it
+        ctx->slots[i].exponent = exponent;
+        ctx->slots[i].modulus = ctx->n;
+        ctx->slots[i].crt = (crt && crt->count > 0) ? crt : NULL;
+        ctx->slots[i].window = ctx->tune.window;
+    }
+    return ctx->slots;
+}
+
+// generate a key pair into the context from its own random state
+// p and q are handed back so the caller can keep or wipe them
+void rsa_ctx_make_keys(rsa_ctx_t *ctx, mpz_t p, mpz_t q, uint64_t nbits, uint64_t iters) {
+    rsa_ctx_make_keys_crt(ctx, 2, nbits, iters);
+    mpz_set(p, ctx->crt.r[0]);
+    mpz_set(q, ctx->crt.r[1]);
+}
+
+// the two primes of a nbits wide n from the context, with no e or d (a pool stores these)
+void rsa_ctx_make_primes(rsa_ctx_t *ctx, mpz_t p, mpz_t q, uint64_t nbits, uint64_t iters) {
+    mpz_t r[2], n;
+    mpz_inits(r[0], r[1], n, NULL);
+    make_primes_r(r, 2, n, nbits, iters, &ctx->rs, ctx->tune.window, ctx_pool(ctx), &ctx->discarded);
+    mpz_swap(p, r[0]);
+    mpz_swap(q, r[1]);
+    mpz_clears(r[0], r[1], n, NULL);
+}
+
+// generate a key pair with count primes (2 to RSA_MAX_PRIMES) into the context,
+// the primes stay in ctx->crt for the private operations
+void rsa_ctx_make_keys_crt(rsa_ctx_t *ctx, size_t count, uint64_t nbits, uint64_t iters) {
+    mpz_t n, e;
+    mpz_inits(n, e, NULL);
+    make_pub_r(ctx->crt.r, count, n, e, nbits, iters, &ctx->rs, ctx->tune.window, ctx_pool(ctx),
+        &ctx->discarded);
+    rsa_ctx_set_pub(ctx, n, e);
+    ctx->crt.count = count;
+    rsa_make_priv_crt(ctx->d, ctx->e, &ctx->crt);
+    mpz_clears(n, e, NULL);
+}
+
+// sign m with the context's private key
+void rsa_ctx_sign(rsa_ctx_t *ctx, mpz_t s, mpz_t m) {
+    // s = m^d (mod n)
+    ctx_private(ctx, s, m);
+}
+
+// verify s against m with the context's public key
+bool rsa_ctx_verify(rsa_ctx_t *ctx, mpz_t m, mpz_t s) {
+    mpz_t verifying;
+    mpz_init(verifying);
+
+    // Verified = s^e (mod n)
+    pow_mod_window(verifying, s, ctx->e, ctx->n, ctx->tune.window);
+    bool valid = mpz_cmp(verifying, m) == 0;
+    mpz_clear(verifying);
+    return valid;
+}
+
+// encrypt the file under the context's public key with the options in opts
+// checkpoints to opts->ckpath (when not NULL) so a restarted run resumes,
+// and writes fixed width blocks behind a header when opts->seekable
+// or LZ compresses the input first when opts->compress (fewer blocks for text)
+// blocks are read a batch at a time, encrypted across the context's workers
+// and written back in order, so the output is the same for any thread count
+bool rsa_ctx_encrypt_file(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, rsa_file_opts_t *opts) {
+    const char *ckpath = opts->ckpath;
+    opts->ckpt_failed = false;
+
+    // compressed offsets do not line up with the input, so no resuming or seeking
+    if (opts->compress && (ckpath || opts->seekable)) {
+        return false;
+    }
+
+    // pick up where an earlier run stopped
+    rsa_ckpt_t ckpt = { 0, 0, 0, 0, 0, 0, 0 };
+    uint32_t mode = RSA_CKPT_ENCRYPT | (opts->seekable ? RSA_CKPT_SEEKABLE : 0);
+    if (ckpath && !ckpt_resume(&ckpt, ckpath, infile, outfile, ctx->n, mode)) {
+        opts->ckpt_failed = true;
+        return false;
+    }
+    uint64_t saved = ckpt.blocks;
+    bool ok = true;
+
+    // block size k = log2(n) - 1 /8, worked out when the key was set
+    size_t k = ctx->k;
+
+    // seekable files pad every block to the hex width of n, so block i sits at a fixed offset
+    int width = 0;
+    if (opts->seekable) {
+        width = (int) mpz_sizeinbase(ctx->n, 16);
+        if (ckpt.out_offset == 0) {
+            rsa_header_t header = { (uint32_t) width, (uint32_t) (k - 1), 0, RSA_CODEC_NONE };
+            rsa_write_header(&header, outfile);
+        }
+    }
+
+    // compress in front of the block loop, blocks then carry the framed stream
+    lz_reader_t lz;
+    if (opts->compress) {
+        rsa_header_t header = { 0, 0, 0, RSA_CODEC_LZ };
+        rsa_write_header(&header, outfile);
+        lz_reader_init(&lz, infile);
+    }
+
+    size_t batch = ctx_batch(ctx);
+    slot_t *slots = ctx_slots(ctx, ctx->e, NULL);
+    wspool_t *pool = ctx_pool(ctx);
+
+    bool more = true;
+    while (more && ok) {
+        // use fread (read in a batch of blocks)
+        // the final read of 0 bytes still makes a pad only block, like before
+        size_t count = 0;
+        while (more && count < batch) {
+            if (opts->compress) {
+                slots[count].len = lz_read(&lz, slots[count].block + 1, k - 1);
+            } else {
+                slots[count].len = fread(slots[count].block + 1, sizeof(uint8_t), k - 1, infile);
+            }
+            more = slots[count].len > 0;
+            count += 1;
+        }
+
+        // encrypt the batch
+        slots_run(pool, encrypt_slot, slots, count);
+
+        // write to file
+        for (size_t i = 0; i < count; i += 1) {
+            gmp_fprintf(outfile, "%0*Zx\n", width, slots[i].c);
+        }
+
+        // checkpoint every RSA_CKPT_BLOCKS blocks (never after the last batch)
+        if (ckpath) {
+            ckpt.blocks += count;
+            if (more && ckpt.blocks - saved >= RSA_CKPT_BLOCKS) {
+                ok = ckpt_save(&ckpt, ckpath, infile, outfile);
+                opts->ckpt_failed = !ok;
+                saved = ckpt.blocks;
+            }
+        }
+    }
+
+    // the run finished, nothing left to resume (a failed save keeps the last good one)
+    if (ckpath && ok) {
+        remove(ckpath);
+    }
+    if (opts->compress) {
+        opts->raw = lz.in;
+        opts->packed = lz.out;
+        lz_reader_clear(&lz);
+    }
+
+    return ok;
+}
+
+// multi-recipient files: the payload is xored with a ChaCha20 keystream under a random
+// session key, and only that key is RSA encrypted, once per public key
+// "#rsa recipients=R", then R lines "#rsa key id=I wrap=C,C,..", then hex lines of payload,
+// then "#rsa tag=T", a Poly1305 tag over the header lines and the payload as in RFC 8439:
+// the one time key is the first keystream block and the payload starts at the second
+
+#define MULTI_SECRET 40 // 32 byte ChaCha20 key then 8 byte nonce
+#define MULTI_LINE 32 // payload bytes per hex line
+#define MULTI_BUF (CHACHA_BLOCK * 64) // payload bytes per read, a multiple of MULTI_LINE
+
+// the low 64 bits of n name the key a wrap line is for
+static uint64_t multi_id(mpz_t n) {
+    mpz_t low;
+    mpz_init(low);
+    mpz_tdiv_r_2exp(low, n, 32);
+    uint64_t id = mpz_get_ui(low);
+    mpz_tdiv_q_2exp(low, n, 32);
+    mpz_tdiv_r_2exp(low, low, 32);
+    id |= (uint64_t) mpz_get_ui(low) << 32;
+    mpz_clear(low);
+    return id;
+}
+
+// split the session secret into the ChaCha20 key words and nonce (little endian)
+static void multi_key(uint32_t key[8], uint64_t *nonce, const uint8_t secret[MULTI_SECRET]) {
+    for (int i = 0; i < 8; i += 1) {
+        key[i] = (uint32_t) secret[4 * i] | (uint32_t) secret[4 * i + 1] << 8
+                 | (uint32_t) secret[4 * i + 2] << 16 | (uint32_t) secret[4 * i + 3] << 24;
+    }
+    *nonce = 0;
+    for (int i = 0; i < 8; i += 1) {
+        *nonce |= (uint64_t) secret[32 + i] << (8 * i);
+    }
+}
+
+// start the tag with the one time key from keystream block 0 and absorb the header lines
+static void multi_mac_init(poly1305_t *mac, const uint32_t key[8], uint64_t nonce, const char *head, size_t len) {
+    uint8_t block[CHACHA_BLOCK];
+    chacha20_block(key, nonce, 0, block);
+    poly1305_init(mac, block);
+    memset(block, 0, sizeof(block));
+
+    static const uint8_t zeros[16] = { 0 };
+    poly1305_update(mac, (const uint8_t *) head, len);
+    poly1305_update(mac, zeros, (16 - len % 16) % 16);
+}
+
+// pad the payload and absorb both lengths, then the tag
+static void multi_mac_finish(poly1305_t *mac, uint64_t head_len, uint64_t len, uint8_t tag[POLY1305_TAG]) {
+    static const uint8_t zeros[16] = { 0 };
+    uint8_t lens[16];
+    poly1305_update(mac, zeros, (16 - len % 16) % 16);
+    for (int i = 0; i < 8; i += 1) {
+        lens[i] = (uint8_t) (head_len >> (8 * i));
+        lens[8 + i] = (uint8_t) (len >> (8 * i));
+    }
+    poly1305_update(mac, lens, sizeof(lens));
+    poly1305_finish(mac, tag);
+}
+
+// write one key line: the secret RSA encrypted for (n, e), k - 1 bytes
+// and the 0xFF pad per block like the file modes
+static void multi_wrap(FILE *outfile, const uint8_t secret[MULTI_SECRET], mpz_t n, mpz_t e) {
+    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    uint8_t block[MULTI_SECRET + 1];
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+
+    fprintf(outfile, "#rsa key id=%016" PRIx64 " wrap=", multi_id(n));
+    for (size_t done = 0; done < MULTI_SECRET;) {
+        size_t len = (k - 1 < MULTI_SECRET - done) ? k - 1 : MULTI_SECRET - done;
+        block[0] = 0xFF;
+        memcpy(block + 1, secret + done, len);
+        mpz_import(m, len + 1, 1, sizeof(uint8_t), 1, 0, block);
+        pow_mod_window(c, m, e, n, tune.window); // c = m^e (mod n)
+        gmp_fprintf(outfile, "%s%Zx", done ? "," : "", c);
+        done += len;
+    }
+    fputc('\n', outfile);
+
+    memset(block, 0, sizeof(block));
+    mpz_clears(m, c, NULL);
+}
+
+// write len payload bytes as hex, MULTI_LINE bytes per line
+static void multi_hex(FILE *outfile, const uint8_t *buf, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    char line[2 * MULTI_LINE + 1];
+    for (size_t i = 0; i < len; i += MULTI_LINE) {
+        size_t count = (len - i < MULTI_LINE) ? len - i : MULTI_LINE;
+        for (size_t j = 0; j < count; j += 1) {
+            line[2 * j] = digits[buf[i + j] >> 4];
+            line[2 * j + 1] = digits[buf[i + j] & 0xF];
+        }
+        line[2 * count] = '\n';
+        fwrite(line, sizeof(char), 2 * count + 1, outfile);
+    }
+}
+
+// value of one hex digit, -1 for anything else
+static int multi_digit(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+// decode len hex digits into out, false on an odd count or a non-digit
+static bool multi_unhex(uint8_t *out, const char *text, size_t len) {
+    if (len % 2 != 0) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i += 2) {
+        int high = multi_digit(text[i]);
+        int low = multi_digit(text[i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        out[i / 2] = (uint8_t) (high << 4 | low);
+    }
+    return true;
+}
+
+// encrypt infile once for every public key (ns[i], es[i]) into a single file
+// any one of the private keys can open with rsa_decrypt_file
+// each extra key costs one key line, the payload is written once
+bool rsa_encrypt_multi(FILE *infile, FILE *outfile, size_t count, mpz_t ns[], mpz_t es[]) {
+    if (count == 0 || count > RSA_MAX_RECIPIENTS) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i += 1) {
+        if (mpz_sizeinbase(ns[i], 2) < 17) {
+            return false; // a block needs room for the pad and one byte
+        }
+    }
+
+    // fresh session secret from the kernel, never from a seeded state
+    uint8_t secret[MULTI_SECRET];
+    rand_src_t rs;
+    if (!rand_init_os(&rs)) {
+        return false;
+    }
+    rand_bytes(&rs, secret, MULTI_SECRET);
+    rand_clear(&rs);
+
+    // the header lines go through memory so the tag can cover them as written
+    char *head = NULL;
+    size_t head_len = 0;
+    FILE *headfile = open_memstream(&head, &head_len);
+    if (!headfile) {
+        memset(secret, 0, sizeof(secret));
+        return false;
+    }
+    rsa_header_t header = { 0, 0, (uint32_t) count, RSA_CODEC_NONE };
+    rsa_write_header(&header, headfile);
+    for (size_t i = 0; i < count; i += 1) {
+        multi_wrap(headfile, secret, ns[i], es[i]);
+    }
+    fclose(headfile);
+    fwrite(head, sizeof(char), head_len, outfile);
+
+    uint32_t key[8];
+    uint64_t nonce;
+    multi_key(key, &nonce, secret);
+    memset(secret, 0, sizeof(secret));
+    poly1305_t mac;
+    multi_mac_init(&mac, key, nonce, head, head_len);
+    free(head);
+
+    // one pass over the input, the tag runs over the ciphertext
+    uint8_t *buf = (uint8_t *) malloc(MULTI_BUF);
+    uint64_t offset = 0;
+    size_t len;
+    while ((len = fread(buf, sizeof(uint8_t), MULTI_BUF, infile)) > 0) {
+        chacha20_xor(key, nonce, CHACHA_BLOCK + offset, buf, len);
+        poly1305_update(&mac, buf, len);
+        multi_hex(outfile, buf, len);
+        offset += len;
+    }
+
+    uint8_t tag[POLY1305_TAG];
+    multi_mac_finish(&mac, head_len, offset, tag);
+    fprintf(outfile, "#rsa tag=");
+    for (int i = 0; i < POLY1305_TAG; i += 1) {
+        fprintf(outfile, "%02x", tag[i]);
+    }
+    fputc('\n', outfile);
+
+    memset(buf, 0, MULTI_BUF);
+    memset(key, 0, sizeof(key));
+    free(buf);
+    return true;
+}
+
+// unwrap one key line into secret if *mine and it is for the context's key
+// false if the line is not a key line, *mine says whether the secret came out of it
+static bool multi_unwrap(rsa_ctx_t *ctx, const char *line, uint64_t id, uint8_t secret[MULTI_SECRET], bool *mine) {
+    size_t k = ctx->k;
+    uint8_t block[MULTI_SECRET + 1];
+    uint64_t entry;
+    int used = 0;
+    if (sscanf(line, "#rsa key id=%" SCNx64 " wrap=%n", &entry, &used) != 1 || used == 0) {
+        return false;
+    }
+    bool ok = true;
+    *mine = *mine && entry == id && k >= 2;
+    size_t done = 0;
+    mpz_t c, m;
+    mpz_inits(c, m, NULL);
+    for (const char *p = line + used;; p += 1) {
+        int step = 0;
+        if (gmp_sscanf(p, "%Zx%n", c, &step) != 1) {
+            ok = false;
+            break;
+        }
+        if (*mine) {
+            size_t len = (k - 1 < MULTI_SECRET - done) ? k - 1 : MULTI_SECRET - done;
+            ctx_private(ctx, m, c); // m = c^d (mod n)
+            // a block that is not pad plus len bytes means another key with the same id
+            if (len == 0 || (mpz_sizeinbase(m, 2) + 7) / 8 != len + 1) {
+                *mine = false;
+            } else {
+                mpz_export(block, NULL, 1, sizeof(uint8_t), 1, 0, m);
+                *mine = block[0] == 0xFF;
+                memcpy(secret + done, block + 1, len);
+                done += len;
+            }
+        }
+        p += step;
+        if (*p != ',') {
+            ok = *p == '\n' || *p == '\0';
+            break;
+        }
+    }
+    *mine = ok && *mine && done == MULTI_SECRET;
+    mpz_clears(c, m, NULL);
+    memset(block, 0, sizeof(block));
+    return ok;
+}
+
+// open a multi-recipient file with the context's private key
+// the header line is already read, false if no key line is for this key
+// or the tag does not match, and then nothing is written
+static bool ctx_decrypt_multi(rsa_ctx_t *ctx, rsa_header_t *header, FILE *infile, FILE *outfile) {
+    uint64_t id = multi_id(ctx->n);
+    uint8_t secret[MULTI_SECRET];
+    bool found = false;
+    bool ok = true;
+
+    // the tag covers the header lines as the encrypt side wrote them
+    char *head = NULL;
+    size_t head_len = 0;
+    FILE *headfile = open_memstream(&head, &head_len);
+    if (!headfile) {
+        return false;
+    }
+    rsa_write_header(header, headfile);
+
+    // find and unwrap this key's line, keeping every line for the tag
+    char *line = NULL;
+    size_t cap = 0;
+    for (uint32_t r = 0; r < header->recipients && ok; r += 1) {
+        bool mine = !found;
+        ok = getline(&line, &cap, infile) > 0 && multi_unwrap(ctx, line, id, secret, &mine);
+        found = found || mine;
+        fputs(ok ? line : "", headfile);
+    }
+    fclose(headfile);
+    if (!ok || !found) {
+        memset(secret, 0, sizeof(secret));
+        free(head);
+        free(line);
+        return false;
+    }
+
+    uint32_t key[8];
+    uint64_t nonce;
+    multi_key(key, &nonce, secret);
+    memset(secret, 0, sizeof(secret));
+    poly1305_t mac;
+    multi_mac_init(&mac, key, nonce, head, head_len);
+    free(head);
+
+    // check the whole payload before any of it is decrypted, the ciphertext waits in a spool
+    FILE *spool = tmpfile();
+    uint8_t *buf = (uint8_t *) malloc(MULTI_BUF);
+    uint8_t want[POLY1305_TAG] = { 0 };
+    bool tagged = false;
+    uint64_t total = 0;
+    ssize_t got;
+    while (spool && !tagged && ok && (got = getline(&line, &cap, infile)) > 0) {
+        if (strncmp(line, "#rsa tag=", 9) == 0) {
+            tagged = strlen(line + 9) >= 2 * POLY1305_TAG && multi_unhex(want, line + 9, 2 * POLY1305_TAG)
+                     && (line[9 + 2 * POLY1305_TAG] == '\n' || line[9 + 2 * POLY1305_TAG] == '\0');
+            ok = tagged;
+            break;
+        }
+        size_t digits = (size_t) got - (line[got - 1] == '\n');
+        ok = digits <= 2 * MULTI_LINE && multi_unhex(buf, line, digits);
+        if (ok) {
+            poly1305_update(&mac, buf, digits / 2);
+            ok = fwrite(buf, sizeof(uint8_t), digits / 2, spool) == digits / 2;
+            total += digits / 2;
+        }
+    }
+    free(line);
+
+    uint8_t tag[POLY1305_TAG];
+    multi_mac_finish(&mac, head_len, total, tag);
+    uint8_t diff = 0;
+    for (int i = 0; i < POLY1305_TAG; i += 1) {
+        diff |= tag[i] ^ want[i];
+    }
+    ok = spool && ok && tagged && diff == 0;
+
+    // only now decrypt, a read at a time
+    if (ok) {
+        rewind(spool);
+        uint64_t offset = 0;
+        size_t len;
+        while ((len = fread(buf, sizeof(uint8_t), MULTI_BUF, spool)) > 0) {
+            chacha20_xor(key, nonce, CHACHA_BLOCK + offset, buf, len);
+            fwrite(buf, sizeof(uint8_t), len, outfile);
+            offset += len;
+        }
+    }
+
+    if (spool) {
+        fclose(spool);
+    }
+    memset(buf, 0, MULTI_BUF);
+    memset(key, 0, sizeof(key));
+    free(buf);
+    return ok;
+}
+
+// decrypt the file under the context's private key
+// checkpoints to opts->ckpath like rsa_ctx_encrypt_file
+// reads either block layout and unpacks compressed files, the header says which
+// same batching as rsa_ctx_encrypt_file
+bool rsa_ctx_decrypt_file(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, rsa_file_opts_t *opts) {
+    const char *ckpath = opts->ckpath;
+    opts->ckpt_failed = false;
+
+    // skip the header, fixed width blocks scan like any other
+    rsa_header_t header;
+    rsa_read_header(&header, infile);
+
+    // one payload for many keys, no checkpoints for those
+    if (header.recipients > 0) {
+        return !ckpath && ctx_decrypt_multi(ctx, &header, infile, outfile);
+    }
+
+    // a compressed file decrypts into the LZ stream and unpacks from there, in one go
+    if (header.codec == RSA_CODEC_UNKNOWN || (header.codec == RSA_CODEC_LZ && ckpath)) {
+        return false;
+    }
+    bool compressed = header.codec == RSA_CODEC_LZ;
+    lz_writer_t lz;
+    if (compressed) {
+        lz_writer_init(&lz, outfile);
+    }
+    bool ok = true;
+
+    // pick up where an earlier run stopped
+    rsa_ckpt_t ckpt = { 0, 0, 0, 0, 0, 0, 0 };
+    if (ckpath && !ckpt_resume(&ckpt, ckpath, infile, outfile, ctx->n, RSA_CKPT_DECRYPT)) {
+        opts->ckpt_failed = true;
+        return false;
+    }
+    uint64_t saved = ckpt.blocks;
+
+    size_t batch = ctx_batch(ctx);
+    slot_t *slots = ctx_slots(ctx, ctx->d, &ctx->crt);
+    wspool_t *pool = ctx_pool(ctx);
+
+    // while there are unprocessed lines in infile
+    bool more = true;
+    while (more && ok) {
+        size_t count = 0;
+        while (count < batch) {
+            if (gmp_fscanf(infile, "%Zx\n", slots[count].c) != 1) {
+                more = false;
+                break;
+            }
+            count += 1;
+        }
+
+        // decrypt the batch
+        slots_run(pool, decrypt_slot, slots, count);
+
+        // write to file, skipping the pad byte
+        for (size_t i = 0; i < count; i += 1) {
+            if (slots[i].len == 0) {
+                continue;
+            }
+            if (compressed) {
+                ok = ok && lz_write(&lz, slots[i].block + 1, slots[i].len - 1);
+            } else {
+                fwrite((slots[i].block + 1), sizeof(uint8_t), slots[i].len - 1, outfile);
+            }
+        }
+
+        // checkpoint every RSA_CKPT_BLOCKS blocks (never after the last batch)
+        if (ckpath) {
+            ckpt.blocks += count;
+            if (more && ckpt.blocks - saved >= RSA_CKPT_BLOCKS) {
+                ok = ckpt_save(&ckpt, ckpath, infile, outfile);
+                opts->ckpt_failed = !ok;
+                saved = ckpt.blocks;
+            }
+        }
+    }
+
+    // the run finished, nothing left to resume (a failed save keeps the last good one)
+    if (ckpath && ok) {
+        remove(ckpath);
+    }
+    if (compressed) {
+        ok = ok && lz_writer_finish(&lz); // a cut off stream ends mid frame
+        lz_writer_clear(&lz);
+    }
+
+    return ok;
+}
+
+// read and decrypt line i of a seekable ciphertext whose lines start at start,
+// false if it is not there or does not decrypt under this key
+static bool range_block(slot_t *slot, FILE *infile, off_t start, uint32_t width, uint64_t i) {
+    off_t line = start + (off_t) (i * (width + 1));
+    if (fseeko(infile, line, SEEK_SET) != 0 || gmp_fscanf(infile, "%Zx", slot->c) != 1) {
+        return false;
+    }
+    decrypt_slot(slot);
+    return slot->len > 0;
+}
+
+// decrypt only the plaintext bytes [offset, offset + len) of a seekable ciphertext
+// block i holds plaintext bytes [i * block, (i + 1) * block) and its line starts
+// i * (width + 1) bytes after the header, so only the covering blocks are read
+// false, with nothing written, when the range runs past the end of the plaintext
+bool rsa_ctx_decrypt_range(
+    rsa_ctx_t *ctx, FILE *infile, FILE *outfile, uint64_t offset, uint64_t len) {
+    rsa_header_t header;
+    rsa_read_header(&header, infile);
+
+    // k = log2(n) - 1 /8, each block carries k - 1 bytes
+    size_t k = ctx->k;
+    if (header.width == 0 || header.block != k - 1) {
+        return false; // not seekable, or made with another key size
+    }
+    off_t start = ftello(infile);
+    if (start < 0 || offset > UINT64_MAX - len) {
+        return false;
+    }
+    if (len == 0) {
+        return true;
+    }
+
+    // one slot of scratch is all a range needs
+    slot_t *slot = ctx_slots(ctx, ctx->d, &ctx->crt);
+
+    // the lines in the file come from its size, and the last ones say how long the
+    // plaintext is, so a range past the end fails before anything is written
+    // the file ends on a pad only block, the data before it ends on a short (or full) one
+    struct stat st;
+    if (fstat(fileno(infile), &st) != 0 || st.st_size < start) {
+        return false;
+    }
+    uint64_t lines = (uint64_t) (st.st_size - start) / (header.width + 1);
+    uint64_t tail = lines - 1; // last line with data in it
+    if (lines == 0 || !range_block(slot, infile, start, header.width, tail)) {
+        return false;
+    }
+    if (slot->len == 1 && tail > 0) {
+        tail -= 1;
+        if (!range_block(slot, infile, start, header.width, tail)) {
+            return false;
+        }
+    }
+    uint64_t total = tail * header.block + (slot->len - 1);
+    if (offset + len > total) {
+        return false;
+    }
+
+    uint64_t first = offset / header.block;
+    uint64_t last = (offset + len - 1) / header.block;
+    for (uint64_t i = first; i <= last; i += 1) {
+        if (!range_block(slot, infile, start, header.width, i)) {
+            return false;
+        }
+
+        // clip the block's bytes to the range (the last block may be short)
+        size_t j = slot->len;
+        uint64_t base = i * header.block;
+        uint64_t lo = (offset > base) ? offset - base : 0;
+        uint64_t hi = (offset + len - base < j - 1) ? offset + len - base : j - 1;
+        if (lo < hi) {
+            fwrite(slot->block + 1 + lo, sizeof(uint8_t), hi - lo, outfile);
+        }
+    }
+
+    return true;
+}
@@ -5,14 +5,116 @@
 #include <stdio.h>
 #include <gmp.h>
 
+#include "randstate.h"
+#include "tune.h"
+#include "wspool.h"
+
+// longest user name rsa_read_pub keeps, and the buffer it fills (one more for the NUL)
+// the scan width is made from RSA_USER_LEN, so the two cannot drift apart
+#define RSA_USER_LEN 1023
+#define RSA_USER_MAX (RSA_USER_LEN + 1)
+
+// blocks between checkpoints in the resumable file modes
+#define RSA_CKPT_BLOCKS 1024
+
+// output bytes a checkpoint fingerprints, a resume has to find the same ones
+#define RSA_CKPT_HEAD 4096
+
+// what a checkpointed run was doing, a resume has to be doing the same
+#define RSA_CKPT_ENCRYPT  1
+#define RSA_CKPT_DECRYPT  2
+#define RSA_CKPT_SEEKABLE 4
+
+// where a checkpointed encrypt or decrypt run got to, and for which key, mode and input
+typedef struct {
+    uint64_t in_offset; // input bytes fully processed
+    uint64_t out_offset; // output bytes written for them
+    uint64_t blocks; // blocks done
+    uint64_t key; // fingerprint of n and the mode
+    uint32_t mode; // RSA_CKPT_ flags
+    uint64_t in_size; // input file size when the run started
+    uint64_t out_head; // fingerprint of the first RSA_CKPT_HEAD bytes of output
+} rsa_ckpt_t;
+
+// options for the file modes
+typedef struct {
+    const char *ckpath; // checkpoint file to save to and resume from, NULL for none
+    bool seekable; // encrypt: fixed width blocks behind a header, for rsa_decrypt_range
+    bool compress; // encrypt: LZ compress the input before the block loop
+    uint64_t raw; // set by a compressed encrypt: input bytes read
+    uint64_t packed; // and bytes left to encrypt after compression
+    bool ckpt_failed; // set when a run failed on its checkpoint (mismatch or save), not the data
+} rsa_file_opts_t;
+
+// compression applied before the block loop, named in the header as "codec=lz"
+typedef enum { RSA_CODEC_NONE, RSA_CODEC_LZ, RSA_CODEC_UNKNOWN } rsa_codec_t;
+
+// most public keys one multi-recipient file can be wrapped for
+#define RSA_MAX_RECIPIENTS 256
+
+// ciphertext header, an optional first line "#rsa width=W block=B" or "#rsa codec=lz",
+// or "#rsa recipients=R" for a multi-recipient file
+typedef struct {
+    uint32_t width; // hex digits per block line, 0 when blocks are variable width
+    uint32_t block; // plaintext bytes per block
+    uint32_t recipients; // key lines that follow, 0 for a single key file
+    rsa_codec_t codec; // how the plaintext was compressed
+} rsa_header_t;
+
+// most prime factors a key can have (multi-prime RSA)
+#define RSA_MAX_PRIMES 4
+
+// prime factors of n and what CRT needs to use them, kept after d in the private key file
+typedef struct {
+    size_t count; // factors, 0 when only n and d are known
+    mpz_t r[RSA_MAX_PRIMES]; // the primes, p and q first
+    mpz_t dr[RSA_MAX_PRIMES]; // d mod (r_i - 1)
+    mpz_t t[RSA_MAX_PRIMES]; // (r_0 * .. * r_i-1)^-1 mod r_i, t[0] is 1
+} rsa_crt_t;
+
+struct rsa_slot;
+
+// everything one thread needs to make keys, encrypt and decrypt on its own
+// threads that each have a context share no state, so they need no lock
+typedef struct {
+    rand_src_t rs; // random source owned by this context
+    tune_t tune; // window, threads and batch for this context
+    wspool_t *pool; // workers, made on first use when tune.threads > 1
+    struct rsa_slot *slots; // batch scratch, kept between calls
+    size_t nslots;
+    mpz_t n, e, d; // key (e or d may be unset)
+    rsa_crt_t crt; // factors of n, private operations use CRT when crt.count > 0
+    size_t k; // block size for n
+    uint64_t discarded; // primes thrown away because n came out short
+} rsa_ctx_t;
+
+// primes rsa_make_pub threw away because n missed the requested width
+extern uint64_t rsa_discarded;
+
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
 
+void rsa_make_pub_pq(mpz_t p, mpz_t q, mpz_t n, mpz_t e);
+
+void rsa_make_pub_crt(rsa_crt_t *crt, size_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
+
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
 
+void rsa_make_priv_crt(mpz_t d, mpz_t e, rsa_crt_t *crt);
+
+void rsa_crt_init(rsa_crt_t *crt);
+
+void rsa_crt_clear(rsa_crt_t *crt);
+
+void rsa_crt_pow(mpz_t out, mpz_t base, rsa_crt_t *crt, uint32_t window);
+
+void rsa_write_crt(rsa_crt_t *crt, FILE *pvfile);
+
+bool rsa_read_crt(rsa_crt_t *crt, mpz_t n, mpz_t d, FILE *pvfile);
+
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
@@ -21,10 +123,59 @@ void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
 void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
 
+bool rsa_encrypt_file_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, rsa_file_opts_t *opts);
+
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
 void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
 
+bool rsa_decrypt_file_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_file_opts_t *opts);
+
+bool rsa_decrypt_range(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, uint64_t offset, uint64_t len);
+
+bool rsa_encrypt_multi(FILE *infile, FILE *outfile, size_t count, mpz_t ns[], mpz_t es[]);
+
+void rsa_write_header(rsa_header_t *header, FILE *outfile);
+
+void rsa_read_header(rsa_header_t *header, FILE *infile);
+
+bool rsa_ckpt_read(rsa_ckpt_t *ckpt, const char *path);
+
+bool rsa_ckpt_write(rsa_ckpt_t *ckpt, const char *path);
+
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+void rsa_sign_crt(mpz_t s, mpz_t m, rsa_crt_t *crt);
+
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
+
+void rsa_ctx_init(rsa_ctx_t *ctx, uint64_t seed);
+
+void rsa_ctx_clear(rsa_ctx_t *ctx);
+
+bool rsa_ctx_seed_os(rsa_ctx_t *ctx);
+
+void rsa_ctx_set_tune(rsa_ctx_t *ctx, tune_t *t);
+
+void rsa_ctx_set_pub(rsa_ctx_t *ctx, mpz_t n, mpz_t e);
+
+void rsa_ctx_set_priv(rsa_ctx_t *ctx, mpz_t n, mpz_t d);
+
+void rsa_ctx_set_crt(rsa_ctx_t *ctx, rsa_crt_t *crt);
+
+void rsa_ctx_make_keys(rsa_ctx_t *ctx, mpz_t p, mpz_t q, uint64_t nbits, uint64_t iters);
+
+void rsa_ctx_make_primes(rsa_ctx_t *ctx, mpz_t p, mpz_t q, uint64_t nbits, uint64_t iters);
+
+void rsa_ctx_make_keys_crt(rsa_ctx_t *ctx, size_t count, uint64_t nbits, uint64_t iters);
+
+void rsa_ctx_sign(rsa_ctx_t *ctx, mpz_t s, mpz_t m);
+
+bool rsa_ctx_verify(rsa_ctx_t *ctx, mpz_t m, mpz_t s);
+
+bool rsa_ctx_encrypt_file(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, rsa_file_opts_t *opts);
+
+bool rsa_ctx_decrypt_file(rsa_ctx_t *ctx, FILE *infile, FILE *outfile, rsa_file_opts_t *opts);
+
+bool rsa_ctx_decrypt_range(
+    rsa_ctx_t *ctx, FILE *infile, FILE *outfile, uint64_t offset, uint64_t len);
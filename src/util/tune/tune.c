@@ -0,0 +1,283 @@
+// Key-size and CPU-aware tuning of the exponent window, thread count and batch size
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+#include "tune.h"
+#include "wspool.h"
+
+// profile lines are "bits threads window batch"
+#define TUNE_MAX_LINES 64
+
+// largest batch the defaults pick or a profile may ask for
+#define TUNE_MAX_BATCH 4096
+
+// calibration times TUNE_ROUNDS exponentiations per rep, TUNE_REPS reps per window, and keeps the best
+#define TUNE_ROUNDS 4
+#define TUNE_REPS   5
+
+// each threads x batch pair is timed over this many batches of blocks
+#define TUNE_BATCHES 4
+
+// settings used before any profile is loaded
+tune_t tune = { 0, 1, 4, 64 };
+
+// online cores, at least one
+static uint32_t cpu_count(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (uint32_t) cores : 1;
+}
+
+// per-core cache we try to keep a batch of blocks inside
+static size_t cache_bytes(void) {
+    long cache = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    return cache > 0 ? (size_t) cache : (size_t) 256 * 1024;
+}
+
+// pick sensible settings without running anything
+void tune_defaults(tune_t *t, uint64_t bits) {
+    t->bits = bits;
+    t->threads = cpu_count();
+
+    // wider windows pay off once the exponent gets long
+    if (bits <= 128) {
+        t->window = 3;
+    } else if (bits <= 512) {
+        t->window = 4;
+    } else if (bits <= 2048) {
+        t->window = 5;
+    } else {
+        t->window = 6;
+    }
+
+    // each block in flight holds its bytes plus a couple of mpz of n's size
+    size_t per_block = 4 * ((bits / 8) + 1);
+    size_t batch = cache_bytes() / per_block;
+    if (batch < 4 * (size_t) t->threads) {
+        batch = 4 * (size_t) t->threads;
+    }
+    if (batch > TUNE_MAX_BATCH) {
+        batch = TUNE_MAX_BATCH;
+    }
+    t->batch = (uint32_t) batch;
+}
+
+// seconds of wall time
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// one block of the timed batch loop
+typedef struct {
+    mpz_t out;
+    mpz_ptr base, exponent, modulus;
+    uint32_t window;
+} tune_block_t;
+
+static void tune_block(void *arg) {
+    tune_block_t *b = (tune_block_t *) arg;
+    pow_mod_window(b->out, b->base, b->exponent, b->modulus, b->window);
+}
+
+// blocks per second through the same loop the file modes run: a batch of blocks
+// submitted to the pool, then a wait, TUNE_BATCHES times (no pool for one thread)
+// about TUNE_BATCHES * batch / threads exponentiations of wall time
+static double time_batches(tune_block_t *blocks, uint32_t threads, uint32_t batch) {
+    wspool_t *pool = threads > 1 ? wspool_create(threads) : NULL;
+    double start = now();
+    for (int round = 0; round < TUNE_BATCHES; round += 1) {
+        for (uint32_t i = 0; i < batch; i += 1) {
+            if (pool) {
+                wspool_submit(pool, tune_block, &blocks[i]);
+            } else {
+                tune_block(&blocks[i]);
+            }
+        }
+        if (pool) {
+            wspool_wait(pool);
+        }
+    }
+    double took = now() - start;
+    wspool_delete(&pool);
+    return (double) TUNE_BATCHES * batch / took;
+}
+
+// thread counts to try: 1, 2, 4 .. and the core count itself when it is not a power of two
+static uint32_t next_threads(uint32_t threads, uint32_t cores) {
+    if (threads < cores && threads * 2 > cores) {
+        return cores;
+    }
+    return threads * 2;
+}
+
+// time pow_mod_window on random operands of the key size and keep the fastest window,
+// then time the batch loop at that window for thread counts 1, 2, 4 .. up to the cores
+// and batches of 1, 2, 4, 8 and 16 blocks per thread, no bigger than the default batch
+// that fits the cache, keeping the pair with the most blocks/s
+void tune_calibrate(tune_t *t, uint64_t bits, bool verbose) {
+    tune_defaults(t, bits);
+
+    // private generator so calibration never disturbs the global state
+    gmp_randstate_t rs;
+    gmp_randinit_mt(rs);
+    gmp_randseed_ui(rs, bits);
+
+    mpz_t base, exponent, modulus, out;
+    mpz_inits(base, exponent, modulus, out, NULL);
+    mpz_urandomb(modulus, rs, bits);
+    mpz_setbit(modulus, bits - 1); // full size modulus
+    mpz_setbit(modulus, 0); // odd like a real n
+    mpz_urandomm(base, rs, modulus);
+    mpz_urandomb(exponent, rs, bits);
+
+    double best = -1.0;
+    for (uint32_t w = 1; w <= POW_MOD_MAX_WINDOW; w += 1) {
+        double fastest = -1.0;
+        for (int rep = 0; rep < TUNE_REPS; rep += 1) {
+            double start = now();
+            for (int round = 0; round < TUNE_ROUNDS; round += 1) {
+                pow_mod_window(out, base, exponent, modulus, w);
+            }
+            double took = now() - start;
+            if (fastest < 0 || took < fastest) {
+                fastest = took;
+            }
+        }
+        if (verbose) {
+            printf("window %" PRIu32 ": %.6f s\n", w, fastest);
+        }
+        if (best < 0 || fastest < best) {
+            best = fastest;
+            t->window = w;
+        }
+    }
+
+    // threads x batch
+    uint32_t cores = t->threads;
+    uint32_t most = 16 * cores;
+    tune_block_t *blocks = (tune_block_t *) calloc(most, sizeof(tune_block_t));
+    for (uint32_t i = 0; i < most; i += 1) {
+        mpz_init(blocks[i].out);
+        blocks[i].base = base;
+        blocks[i].exponent = exponent;
+        blocks[i].modulus = modulus;
+        blocks[i].window = t->window;
+    }
+    uint32_t limit = t->batch;
+    double fastest = -1.0;
+    for (uint32_t threads = 1; threads <= cores; threads = next_threads(threads, cores)) {
+        for (uint32_t per = 1; per <= 16; per *= 2) {
+            uint32_t batch = per * threads;
+            if (per > 1 && batch > limit) {
+                break;
+            }
+            double rate = time_batches(blocks, threads, batch);
+            if (verbose) {
+                printf("threads %" PRIu32 " batch %" PRIu32 ": %.1f blocks/s\n", threads, batch, rate);
+            }
+            if (rate > fastest) {
+                fastest = rate;
+                t->threads = threads;
+                t->batch = batch;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < most; i += 1) {
+        mpz_clear(blocks[i].out);
+    }
+    free(blocks);
+
+    mpz_clears(base, exponent, modulus, out, NULL);
+    gmp_randclear(rs);
+}
+
+// load the settings saved for this modulus size, false if there are none
+// a profile from a bigger host gets its threads cut to the online cores, and a line with
+// a window the table does not support or a batch out of range gets the defaults instead,
+// so a stale or hand-edited rsa.tune cannot ask for thousands of threads or a huge table
+bool tune_load(tune_t *t, uint64_t bits, const char *path) {
+    FILE *profile = fopen(path, "r");
+    if (!profile) {
+        return false;
+    }
+
+    bool found = false;
+    tune_t line;
+    while (fscanf(profile, "%" SCNu64 " %" SCNu32 " %" SCNu32 " %" SCNu32 "\n", &line.bits,
+               &line.threads, &line.window, &line.batch)
+           == 4) {
+        if (line.bits == bits) {
+            found = line.threads > 0 && line.window >= 1 && line.window <= POW_MOD_MAX_WINDOW
+                    && line.batch > 0 && line.batch <= TUNE_MAX_BATCH;
+            break;
+        }
+    }
+    fclose(profile);
+
+    if (!found) {
+        tune_defaults(t, bits);
+        return false;
+    }
+    uint32_t cores = cpu_count();
+    *t = line;
+    if (t->threads > cores) {
+        t->threads = cores;
+    }
+    return true;
+}
+
+// write the settings to the profile, replacing any line for the same modulus size
+bool tune_save(tune_t *t, const char *path) {
+    tune_t lines[TUNE_MAX_LINES];
+    size_t count = 0;
+
+    // keep the entries for other key sizes
+    FILE *profile = fopen(path, "r");
+    if (profile) {
+        tune_t line;
+        while (count < TUNE_MAX_LINES - 1
+               && fscanf(profile, "%" SCNu64 " %" SCNu32 " %" SCNu32 " %" SCNu32 "\n",
+                      &line.bits, &line.threads, &line.window, &line.batch)
+                      == 4) {
+            if (line.bits != t->bits) {
+                lines[count] = line;
+                count += 1;
+            }
+        }
+        fclose(profile);
+    }
+    lines[count] = *t;
+    count += 1;
+
+    profile = fopen(path, "w");
+    if (!profile) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i += 1) {
+        fprintf(profile, "%" PRIu64 " %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", lines[i].bits,
+            lines[i].threads, lines[i].window, lines[i].batch);
+    }
+    fclose(profile);
+    return true;
+}
+
+// print the settings in use
+void tune_print(tune_t *t, FILE *outfile) {
+    fprintf(outfile,
+        "tune (%" PRIu64 " bits) = %" PRIu32 " threads, window %" PRIu32 ", batch %" PRIu32
+        "\n",
+        t->bits, t->threads, t->window, t->batch);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// default profile file, read at startup and written by autotune
+#define TUNE_PROFILE "rsa.tune"
+
+// performance knobs for a given modulus size
+typedef struct {
+    uint64_t bits; // modulus size these settings were chosen for
+    uint32_t threads; // worker threads for the block and prime loops
+    uint32_t window; // exponent window width for pow_mod_window
+    uint32_t batch; // blocks read per batch in the file loops
+} tune_t;
+
+extern tune_t tune;
+
+void tune_defaults(tune_t *t, uint64_t bits);
+
+void tune_calibrate(tune_t *t, uint64_t bits, bool verbose);
+
+bool tune_load(tune_t *t, uint64_t bits, const char *path);
+
+bool tune_save(tune_t *t, const char *path);
+
+void tune_print(tune_t *t, FILE *outfile);
@@ -0,0 +1,260 @@
+// Lock-free work-stealing thread pool shared by prime search and file block processing
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "wspool.h"
+
+// tasks each deque can hold before submit runs them inline
+#define WSPOOL_DEQUE_SIZE 8192
+
+// failed steal sweeps before a worker parks
+#define WSPOOL_SPINS 64
+
+// one deque slot, read by thieves while the owner may be writing
+// (a torn read is only possible when the thief's CAS on top fails)
+typedef struct {
+    _Atomic(wspool_fn) fn;
+    _Atomic(void *) arg;
+} task_t;
+
+// Chase-Lev deque (Le, Pop, Cohen, Zappa Nardelli 2013 C11 version)
+typedef struct {
+    _Atomic int64_t top; // thieves take from here
+    _Atomic int64_t bottom; // owner pushes and pops here
+    task_t tasks[WSPOOL_DEQUE_SIZE];
+} deque_t;
+
+struct wspool {
+    uint32_t threads; // workers including the creating thread
+    deque_t *deques; // one per worker
+    pthread_t *handles; // workers 1 .. threads - 1
+    _Atomic uint64_t pending; // submitted but not finished
+    _Atomic uint64_t queued; // sitting in a deque
+    _Atomic uint32_t sleepers; // workers parked on wake
+    _Atomic bool stop;
+    pthread_mutex_t lock; // only guards parking
+    pthread_cond_t wake;
+};
+
+// which pool and worker slot the current thread belongs to
+static _Thread_local wspool_t *current_pool = NULL;
+static _Thread_local uint32_t current_slot = 0;
+
+// owner only: push to bottom, false if the deque is full
+static bool deque_push(deque_t *dq, wspool_fn fn, void *arg) {
+    int64_t b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&dq->top, memory_order_acquire);
+    if (b - t >= WSPOOL_DEQUE_SIZE) {
+        return false;
+    }
+    task_t *slot = &dq->tasks[b & (WSPOOL_DEQUE_SIZE - 1)];
+    atomic_store_explicit(&slot->fn, fn, memory_order_relaxed);
+    atomic_store_explicit(&slot->arg, arg, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+// owner only: pop from bottom, false if empty or a thief won the last task
+static bool deque_take(deque_t *dq, wspool_fn *fn, void **arg) {
+    int64_t b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+
+    if (t > b) { // empty
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        return false;
+    }
+
+    task_t *slot = &dq->tasks[b & (WSPOOL_DEQUE_SIZE - 1)];
+    *fn = atomic_load_explicit(&slot->fn, memory_order_relaxed);
+    *arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+    if (t == b) { // last task, race the thieves for it
+        bool won = atomic_compare_exchange_strong_explicit(
+            &dq->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+// any thread: take from top, false if empty or another thief got there first
+static bool deque_steal(deque_t *dq, wspool_fn *fn, void **arg) {
+    int64_t t = atomic_load_explicit(&dq->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+    if (t >= b) {
+        return false;
+    }
+
+    task_t *slot = &dq->tasks[t & (WSPOOL_DEQUE_SIZE - 1)];
+    *fn = atomic_load_explicit(&slot->fn, memory_order_relaxed);
+    *arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(
+        &dq->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// run a task that was taken out of a deque
+static void run_task(wspool_t *pool, wspool_fn fn, void *arg) {
+    atomic_fetch_sub(&pool->queued, 1);
+    fn(arg);
+    atomic_fetch_sub(&pool->pending, 1);
+}
+
+// pop own work first, then sweep the other deques starting next door
+static bool find_task(wspool_t *pool, uint32_t slot, wspool_fn *fn, void **arg) {
+    if (deque_take(&pool->deques[slot], fn, arg)) {
+        return true;
+    }
+    for (uint32_t i = 1; i < pool->threads; i += 1) {
+        uint32_t victim = (slot + i) % pool->threads;
+        if (deque_steal(&pool->deques[victim], fn, arg)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// worker loop: run, steal, and park when every deque is empty
+static void *worker(void *data) {
+    wspool_t *pool = (wspool_t *) data;
+    uint32_t slot = current_slot;
+    wspool_fn fn;
+    void *arg;
+    uint32_t misses = 0;
+
+    while (!atomic_load(&pool->stop)) {
+        if (find_task(pool, slot, &fn, &arg)) {
+            run_task(pool, fn, arg);
+            misses = 0;
+            continue;
+        }
+        misses += 1;
+        if (misses < WSPOOL_SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        // park until something is queued (submit checks sleepers after bumping queued)
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (atomic_load(&pool->queued) == 0 && !atomic_load(&pool->stop)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->lock);
+        misses = 0;
+    }
+    return NULL;
+}
+
+// the slot argument has to reach the thread before it reads current_slot
+typedef struct {
+    wspool_t *pool;
+    uint32_t slot;
+} start_t;
+
+static void *worker_start(void *data) {
+    start_t start = *(start_t *) data;
+    free(data);
+    current_pool = start.pool;
+    current_slot = start.slot;
+    return worker(start.pool);
+}
+
+// create a pool of threads workers (the caller counts as one)
+wspool_t *wspool_create(uint32_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    wspool_t *pool = (wspool_t *) calloc(1, sizeof(wspool_t));
+    pool->threads = threads;
+    pool->deques = (deque_t *) calloc(threads, sizeof(deque_t));
+    pool->handles = (pthread_t *) calloc(threads, sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (uint32_t i = 1; i < threads; i += 1) {
+        start_t *start = (start_t *) malloc(sizeof(start_t));
+        start->pool = pool;
+        start->slot = i;
+        pthread_create(&pool->handles[i], NULL, worker_start, start);
+    }
+    return pool;
+}
+
+// stop and join the workers, then free the pool
+void wspool_delete(wspool_t **pool) {
+    if (!*pool) {
+        return;
+    }
+    wspool_t *p = *pool;
+
+    pthread_mutex_lock(&p->lock);
+    atomic_store(&p->stop, true);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for (uint32_t i = 1; i < p->threads; i += 1) {
+        pthread_join(p->handles[i], NULL);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p->handles);
+    free(p->deques);
+    free(p);
+    *pool = NULL;
+}
+
+// queue a task on the calling worker's deque (the creator is worker 0)
+void wspool_submit(wspool_t *pool, wspool_fn fn, void *arg) {
+    uint32_t slot = (current_pool == pool) ? current_slot : 0;
+
+    atomic_fetch_add(&pool->pending, 1);
+    atomic_fetch_add(&pool->queued, 1);
+    if (!deque_push(&pool->deques[slot], fn, arg)) {
+        // deque full, just do it now
+        atomic_fetch_sub(&pool->queued, 1);
+        fn(arg);
+        atomic_fetch_sub(&pool->pending, 1);
+        return;
+    }
+
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// help run tasks until everything submitted so far has finished
+void wspool_wait(wspool_t *pool) {
+    uint32_t slot = (current_pool == pool) ? current_slot : 0;
+    wspool_fn fn;
+    void *arg;
+
+    while (atomic_load(&pool->pending) > 0) {
+        if (find_task(pool, slot, &fn, &arg)) {
+            run_task(pool, fn, arg);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+// number of workers including the creating thread
+uint32_t wspool_size(wspool_t *pool) {
+    return pool->threads;
+}
+
+// slot of the calling thread, 0 for the creating thread
+uint32_t wspool_worker_id(wspool_t *pool) {
+    return (current_pool == pool) ? current_slot : 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// work-stealing thread pool
+// every worker owns a lock-free deque, pushes and pops at its bottom and
+// steals from the top of the others when it runs dry. The thread that
+// created the pool is worker 0: it submits tasks and helps run them in
+// wspool_wait, so only that thread (or a task running in the pool) may
+// submit.
+
+typedef void (*wspool_fn)(void *arg);
+
+typedef struct wspool wspool_t;
+
+wspool_t *wspool_create(uint32_t threads);
+
+void wspool_delete(wspool_t **pool);
+
+void wspool_submit(wspool_t *pool, wspool_fn fn, void *arg);
+
+void wspool_wait(wspool_t *pool);
+
+uint32_t wspool_size(wspool_t *pool);
+
+uint32_t wspool_worker_id(wspool_t *pool);